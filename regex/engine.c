@@ -8,19 +8,49 @@
 #ifdef SNAMES
 #define	matcher	smatcher
 #define	fast	sfast
+#define	lazy	slazy
 #define	slow	sslow
 #define	dissect	sdissect
+#define	onescan	sonescan
 #define	backref	sbackref
 #define	step	sstep
 #define	print	sprint
 #define	at	sat
 #define	match	smat
 #endif
+#ifdef QNAMES
+#define	matcher	qmatcher
+#define	fast	qfast
+#define	lazy	qlazy
+#define	slow	qslow
+#define	dissect	qdissect
+#define	onescan	qonescan
+#define	backref	qbackref
+#define	step	qstep
+#define	print	qprint
+#define	at	qat
+#define	match	qmat
+#endif
+#ifdef WNAMES
+#define	matcher	wmatcher
+#define	fast	wfast
+#define	lazy	wlazy
+#define	slow	wslow
+#define	dissect	wdissect
+#define	onescan	wonescan
+#define	backref	wbackref
+#define	step	wstep
+#define	print	wprint
+#define	at	wat
+#define	match	wmat
+#endif
 #ifdef LNAMES
 #define	matcher	lmatcher
 #define	fast	lfast
+#define	lazy	llazy
 #define	slow	lslow
 #define	dissect	ldissect
+#define	onescan	lonescan
 #define	backref	lbackref
 #define	step	lstep
 #define	print	lprint
@@ -38,6 +68,8 @@ struct match {
 	char *endp;		/* end of string -- virtual NUL here */
 	char *coldp;		/* can be no match starting before here */
 	char **lastpos;		/* [nplus+1] */
+	struct re_scratch *scratch;	/* where the space above comes from */
+	struct re_dfa *dfa;	/* lazy DFA for fast(), if it can have one */
 	STATEVARS;
 	states st;		/* current states */
 	states fresh;		/* states for a fresh start */
@@ -60,15 +92,18 @@ struct match {
 /*
  - matcher - the actual matching engine
  == static int matcher(register struct re_guts *g, char *string, \
- ==	size_t nmatch, regmatch_t pmatch[], int eflags);
+ ==	size_t len, size_t nmatch, regmatch_t pmatch[], int eflags, \
+ ==	struct re_scratch *sc);
  */
-static int			/* 0 success, REG_NOMATCH failure */
-matcher(g, string, nmatch, pmatch, eflags)
+static int			/* 0 success, REG_NOMATCH or REG_EBUDGET failure */
+matcher(g, string, len, nmatch, pmatch, eflags, sc)
 register struct re_guts *g;
 char *string;
+size_t len;			/* length of string, unless REG_STARTEND */
 size_t nmatch;
 regmatch_t pmatch[];
 int eflags;
+struct re_scratch *sc;		/* where to get working space */
 {
 	register char *endp;
 	register int i;
@@ -88,26 +123,21 @@ int eflags;
 		stop = string + pmatch[0].rm_eo;
 	} else {
 		start = string;
-		stop = start + strlen(start);
+		stop = start + len;
 	}
 	if (stop < start)
 		return(REG_INVARG);
 
 	/* prescreening; this does wonders for this rather slow code */
-	if (g->must != NULL) {
-		for (dp = start; dp < stop; dp++)
-			if (*dp == g->must[0] && stop - dp >= g->mlen &&
-				memcmp(dp, g->must, (size_t)g->mlen) == 0)
-				break;
-		if (dp == stop)		/* we didn't find g->must */
-			return(REG_NOMATCH);
-	}
+	if (g->must != NULL && mustfind(g, start, stop) == NULL)
+		return(REG_NOMATCH);	/* we didn't find g->must */
 
 	/* match struct setup */
 	m->g = g;
 	m->eflags = eflags;
 	m->pmatch = NULL;
 	m->lastpos = NULL;
+	m->scratch = sc;
 	m->offp = string;
 	m->beginp = start;
 	m->endp = stop;
@@ -117,9 +147,19 @@ int eflags;
 	SETUP(m->tmp);
 	SETUP(m->empty);
 	CLEAR(m->empty);
+	m->dfa = ((eflags&REG_TRACE) || sc->nodfa) ? NULL :
+						dfaget(sc, g, SETSIZE(m));
 
 	/* this loop does only one repetition except for backrefs */
 	for (;;) {
+		/* no match can start before a character that begins one */
+		if (g->firstmap != NULL) {
+			start = firstskip(g, start, stop);
+			if (start == stop) {
+				STATETEARDOWN(m);
+				return(REG_NOMATCH);
+			}
+		}
 		endp = fast(m, start, stop, gf, gl);
 		if (endp == NULL) {		/* a miss */
 			STATETEARDOWN(m);
@@ -133,39 +173,49 @@ int eflags;
 		for (;;) {
 			NOTE("finding start");
 			endp = slow(m, m->coldp, stop, gf, gl);
-			if (endp != NULL)
+			if (endp != NULL || OVER(m))
 				break;
 			assert(m->coldp < m->endp);
 			m->coldp++;
 		}
+		if (OVER(m)) {
+			STATETEARDOWN(m);
+			return(REG_EBUDGET);
+		}
 		if (nmatch == 1 && !g->backrefs)
 			break;		/* no further info needed */
 
 		/* oh my, he wants the subexpressions... */
-		if (m->pmatch == NULL)
-			m->pmatch = (regmatch_t *)malloc((m->g->nsub + 1) *
-							sizeof(regmatch_t));
+		if (m->pmatch == NULL &&
+				GROW(sc->pmatch, sc->npmatch, m->g->nsub + 1) == 0)
+			m->pmatch = sc->pmatch;
 		if (m->pmatch == NULL) {
 			STATETEARDOWN(m);
 			return(REG_ESPACE);
 		}
 		for (i = 1; i <= m->g->nsub; i++)
 			m->pmatch[i].rm_so = m->pmatch[i].rm_eo = -1;
-		if (!g->backrefs && !(m->eflags&REG_BACKR)) {
+		if (g->onepass != NULL && !(m->eflags&REG_BACKR)) {
+			NOTE("one pass");
+			dp = onescan(m, m->coldp, endp);
+		} else if (!g->backrefs && !(m->eflags&REG_BACKR)) {
 			NOTE("dissecting");
 			dp = dissect(m, m->coldp, endp, gf, gl);
 		} else {
-			if (g->nplus > 0 && m->lastpos == NULL)
-				m->lastpos = (char **)malloc((g->nplus+1) *
-							sizeof(char *));
+			if (g->nplus > 0 && m->lastpos == NULL &&
+					GROW(sc->lastpos, sc->nlastpos, g->nplus + 1) == 0)
+				m->lastpos = sc->lastpos;
 			if (g->nplus > 0 && m->lastpos == NULL) {
-				free(m->pmatch);
 				STATETEARDOWN(m);
 				return(REG_ESPACE);
 			}
 			NOTE("backref dissect");
 			dp = backref(m, m->coldp, endp, gf, gl, (sopno)0);
 		}
+		if (OVER(m)) {
+			STATETEARDOWN(m);
+			return(REG_EBUDGET);
+		}
 		if (dp != NULL)
 			break;
 
@@ -190,6 +240,10 @@ int eflags;
 			dp = backref(m, m->coldp, endp, gf, gl, (sopno)0);
 		}
 		assert(dp == NULL || dp == endp);
+		if (OVER(m)) {
+			STATETEARDOWN(m);
+			return(REG_EBUDGET);
+		}
 		if (dp != NULL)		/* found a shorter one */
 			break;
 
@@ -215,10 +269,6 @@ int eflags;
 			}
 	}
 
-	if (m->pmatch != NULL)
-		free((char *)m->pmatch);
-	if (m->lastpos != NULL)
-		free((char *)m->lastpos);
 	STATETEARDOWN(m);
 	return(0);
 }
@@ -253,6 +303,8 @@ sopno stopst;
 	AT("diss", start, stop, startst, stopst);
 	sp = start;
 	for (ss = startst; ss < stopst; ss = es) {
+		if (SPEND(m))
+			return(NULL);	/* out of budget, matcher() notices */
 		/* identify end of subRE */
 		es = ss;
 		switch (OP(m->g->strip[es])) {
@@ -294,6 +346,8 @@ sopno stopst;
 			for (;;) {
 				/* how long could this one be? */
 				rest = slow(m, sp, stp, ss, es);
+				if (OVER(m))
+					return(NULL);
 				assert(rest != NULL);	/* it did match */
 				/* could the rest match the rest? */
 				tail = slow(m, rest, stop, es, stopst);
@@ -308,9 +362,9 @@ sopno stopst;
 			/* did innards match? */
 			if (slow(m, sp, rest, ssub, esub) != NULL) {
 				dp = dissect(m, sp, rest, ssub, esub);
-				assert(dp == rest);
+				assert(dp == rest || OVER(m));
 			} else		/* no */
-				assert(sp == rest);
+				assert(sp == rest || OVER(m));
 			sp = rest;
 			break;
 		case OPLUS_:
@@ -318,6 +372,8 @@ sopno stopst;
 			for (;;) {
 				/* how long could this one be? */
 				rest = slow(m, sp, stp, ss, es);
+				if (OVER(m))
+					return(NULL);
 				assert(rest != NULL);	/* it did match */
 				/* could the rest match the rest? */
 				tail = slow(m, rest, stop, es, stopst);
@@ -338,6 +394,8 @@ sopno stopst;
 				oldssp = ssp;	/* on to next try */
 				ssp = sep;
 			}
+			if (OVER(m))
+				return(NULL);
 			if (sep == NULL) {
 				/* last successful match */
 				sep = ssp;
@@ -346,7 +404,7 @@ sopno stopst;
 			assert(sep == rest);	/* must exhaust substring */
 			assert(slow(m, ssp, sep, ssub, esub) == rest);
 			dp = dissect(m, ssp, sep, ssub, esub);
-			assert(dp == sep);
+			assert(dp == sep || OVER(m));
 			sp = rest;
 			break;
 		case OCH_:
@@ -354,6 +412,8 @@ sopno stopst;
 			for (;;) {
 				/* how long could this one be? */
 				rest = slow(m, sp, stp, ss, es);
+				if (OVER(m))
+					return(NULL);
 				assert(rest != NULL);	/* it did match */
 				/* could the rest match the rest? */
 				tail = slow(m, rest, stop, es, stopst);
@@ -369,6 +429,8 @@ sopno stopst;
 			for (;;) {	/* find first matching branch */
 				if (slow(m, sp, rest, ssub, esub) == rest)
 					break;	/* it matched all of it */
+				if (OVER(m))
+					return(NULL);
 				/* that one missed, try next one */
 				assert(OP(m->g->strip[esub]) == OOR1);
 				esub++;
@@ -381,7 +443,7 @@ sopno stopst;
 					assert(OP(m->g->strip[esub]) == O_CH);
 			}
 			dp = dissect(m, sp, rest, ssub, esub);
-			assert(dp == rest);
+			assert(dp == rest || OVER(m));
 			sp = rest;
 			break;
 		case O_PLUS:
@@ -411,6 +473,59 @@ sopno stopst;
 	return(sp);
 }
 
+/*
+ - onescan - figure out what matched what in one walk, for one-pass REs
+ == static char *onescan(register struct match *m, char *start, char *stop);
+ *
+ * Only for REs findonepass() made a program for, with the same answers
+ * as dissect() over the whole RE would give.
+ */
+static char *			/* == stop (success) always */
+onescan(m, start, stop)
+register struct match *m;
+char *start;
+char *stop;
+{
+	register struct onepass *o = m->g->onepass;
+	register cat_t *cats = m->g->categories;
+	register regmatch_t *pm = m->pmatch;
+	register char *p;
+	register int *a;
+	register int *end;
+	register int node = 0;
+	register int e;
+	register size_t i;
+
+	AT("one", start, stop, m->g->firststate+1, m->g->laststate);
+	for (p = start; ; p++) {
+		if (p == stop)
+			e = o->accept[node];
+		else
+			e = o->next[node*o->ncat + cats[(int)*p]];
+		assert(e >= 0);		/* it did match */
+		end = &o->act[o->acts[e+1]];
+		for (a = &o->act[o->acts[e]]; a < end; a++) {
+			i = PSUB(*a);
+			assert(0 < i && i <= m->g->nsub);
+			switch (PWHAT(*a)) {
+			case PSO:
+				pm[i].rm_so = p - m->offp;
+				break;
+			case PEO:
+				pm[i].rm_eo = p - m->offp;
+				break;
+			case PCLR:	/* round a loop again */
+				for (a++; i <= (size_t)PSUB(*a); i++)
+					pm[i].rm_so = pm[i].rm_eo = -1;
+				break;
+			}
+		}
+		if (p == stop)
+			return(stop);
+		node = o->to[e];
+	}
+}
+
 /*
  - backref - figure out what matched what, figuring in back references
  == static char *backref(register struct match *m, char *start, \
@@ -439,6 +554,8 @@ sopno lev;			/* PLUS nesting level */
 	register cset *cs;
 
 	AT("back", start, stop, startst, stopst);
+	if (SPEND(m))
+		return(NULL);	/* out of budget, matcher() notices */
 	sp = start;
 
 	/* get as far as we can with easy stuff */
@@ -446,7 +563,7 @@ sopno lev;			/* PLUS nesting level */
 	for (ss = startst; !hard && ss < stopst; ss++)
 		switch (OP(s = m->g->strip[ss])) {
 		case OCHAR:
-			if (sp == stop || *sp++ != (char)OPND(s))
+			if (sp == stop || m->g->fold[(int)*sp++] != (char)OPND(s))
 				return(NULL);
 			break;
 		case OANY:
@@ -633,12 +750,16 @@ sopno stopst;
 	register states fresh = m->fresh;
 	register states tmp = m->tmp;
 	register char *p = start;
-	register int c = (start == m->beginp) ? OUT : *(start-1);
+	register char *fold = m->g->fold;
+	register int c = (start == m->beginp) ? OUT : fold[(int)*(start-1)];
 	register int lastc;	/* previous c */
 	register int flagch;
 	register int i;
 	register char *coldp;	/* last p after which no match was underway */
 
+	if (m->dfa != NULL)
+		return(lazy(m, start, stop, startst, stopst));
+
 	CLEAR(st);
 	SET1(st, startst);
 	st = step(m->g, startst, stopst, st, NOTHING, st);
@@ -648,7 +769,7 @@ sopno stopst;
 	for (;;) {
 		/* next character */
 		lastc = c;
-		c = (p == m->endp) ? OUT : *p;
+		c = (p == m->endp) ? OUT : fold[(int)*p];
 		if (EQ(st, fresh))
 			coldp = p;
 
@@ -707,6 +828,76 @@ sopno stopst;
 		return(NULL);
 }
 
+/*
+ - lazy - fast() by way of a DFA built as we go
+ == static char *lazy(register struct match *m, char *start, \
+ ==	char *stop, sopno startst, sopno stopst);
+ *
+ * Same answers as fast(), but each character costs one table lookup
+ * once the DFA has seen the transition before, instead of a step()
+ * through the whole strip.  Only for REs dfaget() accepts, so there
+ * are no BOL/EOL/BOW/EOW steps to worry about.  Characters that fold
+ * alike share a category, so only step() needs to see them folded.
+ */
+static char *			/* where tentative match ended, or NULL */
+lazy(m, start, stop, startst, stopst)
+register struct match *m;
+char *start;
+char *stop;
+sopno startst;
+sopno stopst;
+{
+	register struct re_dfa *d = m->dfa;
+	register cat_t *cats = m->g->categories;
+	states st = m->st;	/* not register, SETBYTES may take addresses */
+	states fresh = m->fresh;
+	states tmp = m->tmp;
+	register char *p = start;
+	register int ds;	/* current DFA state */
+	register int ns;	/* next DFA state */
+	register int *np;	/* where ns is remembered */
+	register int nflush;
+	register char *coldp = NULL;	/* as in fast() */
+
+	CLEAR(st);
+	SET1(st, startst);
+	st = step(m->g, startst, stopst, st, NOTHING, st);
+	ASSIGN(fresh, st);
+	ds = dfastate(d, SETBYTES(fresh),
+				DFRESH | (ISSET(fresh, stopst) ? DACCEPT : 0));
+	for (;;) {
+		if (d->flags[ds]&DFRESH)
+			coldp = p;
+		if ((d->flags[ds]&DACCEPT) || p == stop)
+			break;		/* NOTE BREAK OUT */
+
+		np = &d->next[ds*d->ncat + cats[(int)*p]];
+		ns = *np;
+		if (ns < 0) {
+			/* haven't been this way before, work it out */
+			LOADSET(tmp, d->sets + ds*d->ssize);
+			ASSIGN(st, fresh);
+			st = step(m->g, startst, stopst, tmp, m->g->fold[(int)*p],
+									st);
+			nflush = d->nflush;
+			ns = dfastate(d, SETBYTES(st),
+					(EQ(st, fresh) ? DFRESH : 0) |
+					(ISSET(st, stopst) ? DACCEPT : 0));
+			if (d->nflush == nflush)	/* np still good */
+				*np = ns;
+		}
+		ds = ns;
+		p++;
+	}
+
+	assert(coldp != NULL);
+	m->coldp = coldp;
+	if (d->flags[ds]&DACCEPT)
+		return(p+1);
+	else
+		return(NULL);
+}
+
 /*
  - slow - step through the string more deliberately
  == static char *slow(register struct match *m, char *start, \
@@ -724,7 +915,8 @@ sopno stopst;
 	register states empty = m->empty;
 	register states tmp = m->tmp;
 	register char *p = start;
-	register int c = (start == m->beginp) ? OUT : *(start-1);
+	register char *fold = m->g->fold;
+	register int c = (start == m->beginp) ? OUT : fold[(int)*(start-1)];
 	register int lastc;	/* previous c */
 	register int flagch;
 	register int i;
@@ -737,9 +929,12 @@ sopno stopst;
 	st = step(m->g, startst, stopst, st, NOTHING, st);
 	matchp = NULL;
 	for (;;) {
+		if (SPEND(m))
+			return(NULL);	/* out of budget, callers notice */
+
 		/* next character */
 		lastc = c;
-		c = (p == m->endp) ? OUT : *p;
+		c = (p == m->endp) ? OUT : fold[(int)*p];
 
 		/* is there an EOL and/or BOL between lastc and c? */
 		flagch = '\0';
@@ -1010,8 +1205,10 @@ int ch;
 
 #undef	matcher
 #undef	fast
+#undef	lazy
 #undef	slow
 #undef	dissect
+#undef	onescan
 #undef	backref
 #undef	step
 #undef	print
@@ -3,6 +3,8 @@
 #include <sys/types.h>
 #include <regex.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "main.ih"
 
@@ -19,6 +21,9 @@ regoff_t endoff = 0;
 
 extern int split();
 extern void regprint();
+extern void *sysre_comp();
+extern int sysre_exec();
+extern void sysre_free();
 
 /*
  - main - do the simple case, hand off to regress() for regression
@@ -35,20 +40,32 @@ char *argv[];
 	size_t len;
 	int c;
 	int errflg = 0;
+	int rounds = 0;
+	char *corpus = NULL;
+	int sys = 0;
 	register int i;
 	extern int optind;
 	extern char *optarg;
 
 	progname = argv[0];
 
-	while ((c = getopt(argc, argv, "c:e:S:E:x")) != EOF)
+	while ((c = getopt(argc, argv, "b:c:e:f:sS:E:x")) != EOF)
 		switch (c) {
+		case 'b':	/* benchmark, this many rounds */
+			rounds = atoi(optarg);
+			break;
 		case 'c':	/* compile options */
 			copts = options('c', optarg);
 			break;
 		case 'e':	/* execute options */
 			eopts = options('e', optarg);
 			break;
+		case 'f':	/* benchmark corpus */
+			corpus = optarg;
+			break;
+		case 's':	/* benchmark the system regex too */
+			sys++;
+			break;
 		case 'S':	/* start offset */
 			startoff = (regoff_t)atoi(optarg);
 			break;
@@ -66,9 +83,16 @@ char *argv[];
 	if (errflg) {
 		fprintf(stderr, "usage: %s ", progname);
 		fprintf(stderr, "[-c copt][-C][-d] [re]\n");
+		fprintf(stderr, "       %s -b rounds [-f corpus][-s] <tests\n",
+								progname);
 		exit(2);
 	}
 
+	if (rounds > 0) {
+		bench(stdin, rounds, corpus, sys);
+		exit(status);
+	}
+
 	if (optind >= argc) {
 		regress(stdin);
 		exit(status);
@@ -195,6 +219,263 @@ FILE *in;
 	}
 }
 
+/*
+ - bench - replay the test patterns (and a corpus) for timing
+ == void bench(FILE *in, int rounds, char *corpus, int sys);
+ *
+ * Every pattern that compiles is run against its own test string and
+ * against every line of the corpus, once without submatches and once with
+ * NSUBS of them, through plain regexec() and through regexec_scratch()
+ * with one scratch kept for the whole run (which is how treexpr uses it,
+ * and the only way the lazy DFAs get reused).  With sys, patterns the system regcomp won't take are
+ * dropped and the system's times are reported alongside.
+ */
+void
+bench(in, rounds, corpus, sys)
+FILE *in;
+int rounds;
+char *corpus;			/* NULL for none */
+int sys;
+{
+	char inbuf[1000];
+#	define	MAXF	10
+	char *f[MAXF];
+	int nf;
+	char **pat = NULL;	/* patterns, after fixstr */
+	int *popts = NULL;
+	char **str = NULL;	/* each pattern's own test string */
+	int np = 0;
+	int npalloc = 0;
+	char **lines = NULL;	/* the corpus */
+	int nl = 0;
+	int nlalloc = 0;
+	regex_t *re;
+	void **sre = NULL;
+#	define	NSUBS	10
+	regmatch_t subs[NSUBS];
+	FILE *cf;
+	int opts;
+	int i;
+	int j;
+	int r;
+	int k;
+	double t;
+	double tcomp;
+	double texec[2][2];	/* [with scratch][with submatches] */
+	regscratch_t *sc;
+	double scomp;
+	double sexec[2];
+	long ncalls;
+
+	while (fgets(inbuf, sizeof(inbuf), in) != NULL) {
+		line++;
+		if (inbuf[0] == '#' || inbuf[0] == '\n')
+			continue;			/* NOTE CONTINUE */
+		inbuf[strlen(inbuf)-1] = '\0';
+		nf = split(inbuf, f, MAXF, "\t\t");
+		if (nf < 3) {
+			fprintf(stderr, "bad input, line %d\n", line);
+			exit(1);
+		}
+		for (i = 0; i < nf; i++)
+			if (strcmp(f[i], "\"\"") == 0)
+				f[i] = "";
+		/* compile errors aren't interesting, PEND needs re_endp */
+		if (opt('C', f[1]) || opt('p', f[1]))
+			continue;			/* NOTE CONTINUE */
+		for (k = 0; k < 2; k++) {
+			opts = options('c', f[1]);
+			if (k == 1 && !opt('&', f[1]))
+				break;
+			if (k == 1)
+				opts &= ~REG_EXTENDED;
+			if (np + 1 > npalloc) {
+				npalloc = npalloc ? npalloc * 2 : 256;
+				pat = (char **)realloc((char *)pat,
+						npalloc * sizeof(char *));
+				str = (char **)realloc((char *)str,
+						npalloc * sizeof(char *));
+				popts = (int *)realloc((char *)popts,
+						npalloc * sizeof(int));
+				if (pat == NULL || str == NULL || popts == NULL) {
+					fprintf(stderr, "out of memory\n");
+					exit(1);
+				}
+			}
+			pat[np] = strdup(f[0]);
+			str[np] = strdup(f[2]);
+			if (pat[np] == NULL || str[np] == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+			fixstr(pat[np]);
+			fixstr(str[np]);
+			popts[np++] = opts;
+		}
+	}
+
+	if (corpus != NULL) {
+		cf = fopen(corpus, "r");
+		if (cf == NULL) {
+			fprintf(stderr, "%s: can't open %s\n", progname, corpus);
+			exit(1);
+		}
+		while (fgets(inbuf, sizeof(inbuf), cf) != NULL) {
+			inbuf[strcspn(inbuf, "\n")] = '\0';
+			if (nl + 1 > nlalloc) {
+				nlalloc = nlalloc ? nlalloc * 2 : 256;
+				lines = (char **)realloc((char *)lines,
+						nlalloc * sizeof(char *));
+				if (lines == NULL) {
+					fprintf(stderr, "out of memory\n");
+					exit(1);
+				}
+			}
+			lines[nl] = strdup(inbuf);
+			if (lines[nl++] == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		fclose(cf);
+	}
+
+	/* keep only what compiles, everywhere we're timing */
+	re = (regex_t *)malloc((np ? np : 1) * sizeof(regex_t));
+	if (sys)
+		sre = (void **)malloc((np ? np : 1) * sizeof(void *));
+	if (re == NULL || (sys && sre == NULL)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = j = 0; i < np; i++) {
+		if (regcomp(&re[0], pat[i], popts[i]) != 0)
+			continue;			/* NOTE CONTINUE */
+		regfree(&re[0]);
+		if (sys) {
+			if (popts[i]&REG_NOSPEC)
+				continue;		/* NOTE CONTINUE */
+			sre[0] = sysre_comp(pat[i], popts[i]&REG_EXTENDED,
+						popts[i]&REG_ICASE,
+						popts[i]&REG_NOSUB,
+						popts[i]&REG_NEWLINE);
+			if (sre[0] == NULL)
+				continue;		/* NOTE CONTINUE */
+			sysre_free(sre[0]);
+		}
+		pat[j] = pat[i];
+		str[j] = str[i];
+		popts[j++] = popts[i];
+	}
+	np = j;
+
+	t = now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < np; i++)
+			(void) regcomp(&re[i], pat[i], popts[i]);
+		if (r + 1 < rounds)
+			for (i = 0; i < np; i++)
+				regfree(&re[i]);
+	}
+	tcomp = now() - t;
+	for (k = 0; k < 2; k++) {
+		t = now();
+		for (r = 0; r < rounds; r++)
+			for (i = 0; i < np; i++) {
+				(void) regexec(&re[i], str[i],
+						k ? NSUBS : 0, subs, 0);
+				for (j = 0; j < nl; j++)
+					(void) regexec(&re[i], lines[j],
+						k ? NSUBS : 0, subs, 0);
+			}
+		texec[0][k] = now() - t;
+	}
+	sc = notbuiltin_regscratch_alloc();
+	if (sc == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (k = 0; k < 2; k++) {
+		t = now();
+		for (r = 0; r < rounds; r++)
+			for (i = 0; i < np; i++) {
+				(void) notbuiltin_regexec_scratch(&re[i],
+						str[i], k ? NSUBS : 0, subs,
+						0, sc);
+				for (j = 0; j < nl; j++)
+					(void) notbuiltin_regexec_scratch(
+						&re[i], lines[j],
+						k ? NSUBS : 0, subs, 0, sc);
+			}
+		texec[1][k] = now() - t;
+	}
+	notbuiltin_regscratch_free(sc);
+	for (i = 0; i < np; i++)
+		regfree(&re[i]);
+
+	if (sys) {
+		t = now();
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < np; i++)
+				sre[i] = sysre_comp(pat[i],
+						popts[i]&REG_EXTENDED,
+						popts[i]&REG_ICASE,
+						popts[i]&REG_NOSUB,
+						popts[i]&REG_NEWLINE);
+			if (r + 1 < rounds)
+				for (i = 0; i < np; i++)
+					sysre_free(sre[i]);
+		}
+		scomp = now() - t;
+		for (k = 0; k < 2; k++) {
+			t = now();
+			for (r = 0; r < rounds; r++)
+				for (i = 0; i < np; i++) {
+					(void) sysre_exec(sre[i], str[i],
+							k ? NSUBS : 0);
+					for (j = 0; j < nl; j++)
+						(void) sysre_exec(sre[i],
+							lines[j], k ? NSUBS : 0);
+				}
+			sexec[k] = now() - t;
+		}
+		for (i = 0; i < np; i++)
+			sysre_free(sre[i]);
+	}
+
+	if (np == 0) {
+		fprintf(stderr, "%s: nothing to benchmark\n", progname);
+		status = 1;
+		return;
+	}
+	ncalls = (long)rounds * np * (nl + 1);
+	printf("%d patterns, %d corpus lines, %d rounds; ns per call\n",
+							np, nl, rounds);
+	printf("%-8s %10s %10s %10s\n", "", "compile", "exec", "exec+sub");
+	printf("%-8s %10.0f %10.0f %10.0f\n", "regexec",
+				tcomp / ((double)rounds * np),
+				texec[0][0] / ncalls, texec[0][1] / ncalls);
+	printf("%-8s %10s %10.0f %10.0f\n", "scratch", "-",
+				texec[1][0] / ncalls, texec[1][1] / ncalls);
+	if (sys)
+		printf("%-8s %10.0f %10.0f %10.0f\n", "system",
+				scomp / ((double)rounds * np),
+				sexec[0] / ncalls, sexec[1] / ncalls);
+}
+
+/*
+ - now - a monotonic clock, in nanoseconds
+ == static double now(void);
+ */
+static double
+now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double)ts.tv_sec * 1e9 + (double)ts.tv_nsec);
+}
+
 /*
  - try - try it, and report on problems
  == void try(char *f0, char *f1, char *f2, char *f3, char *f4, int opts);
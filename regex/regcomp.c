@@ -33,6 +33,7 @@ struct parse {
 #include "regcomp.ih"
 
 static char nuls[10];		/* place to point scanner in event of error */
+static unsigned long serials = 0;	/* source of re_guts serial numbers */
 
 /*
  * macros for use with parse structure
@@ -143,11 +144,21 @@ int cflags;
 	g->neol = 0;
 	g->must = NULL;
 	g->mlen = 0;
+	g->firstmap = NULL;
+	g->nfirst = 0;
+	g->onepass = NULL;
 	g->nsub = 0;
 	g->ncategories = 1;	/* category 0 is "everything else" */
 	g->categories = &g->catspace[-(CHAR_MIN)];
 	(void) memset((char *)g->catspace, 0, NC*sizeof(cat_t));
 	g->backrefs = 0;
+	g->serial = ++serials;
+	g->fold = &g->foldspace[-(CHAR_MIN)];
+	for (i = CHAR_MIN; i <= CHAR_MAX; i++)
+		if ((cflags&REG_ICASE) && isupper((uch)i))
+			g->fold[i] = (char)tolower((uch)i);
+		else
+			g->fold[i] = (char)i;
 
 	/* do it */
 	EMIT(OEND, 0);
@@ -165,6 +176,8 @@ int cflags;
 	categorize(p, g);
 	stripsnug(p, g);
 	findmust(p, g);
+	findfirst(p, g);
+	findonepass(p, g);
 	g->nplus = pluscount(p, g);
 	g->magic = MAGIC2;
 	preg->re_nsub = g->nsub;
@@ -829,36 +842,12 @@ int ch;
 		return(ch);
 }
 
-/*
- - bothcases - emit a dualcase version of a two-case character
- == static void bothcases(register struct parse *p, int ch);
- *
- * Boy, is this implementation ever a kludge...
- */
-static void
-bothcases(p, ch)
-register struct parse *p;
-int ch;
-{
-	register char *oldnext = p->next;
-	register char *oldend = p->end;
-	char bracket[3];
-
-	assert(othercase(ch) != ch);	/* p_bracket() would recurse */
-	p->next = bracket;
-	p->end = bracket+2;
-	bracket[0] = ch;
-	bracket[1] = ']';
-	bracket[2] = '\0';
-	p_bracket(p);
-	assert(p->next == bracket+2);
-	p->next = oldnext;
-	p->end = oldend;
-}
-
 /*
  - ordinary - emit an ordinary character
  == static void ordinary(register struct parse *p, register int ch);
+ *
+ * Under REG_ICASE the literal is folded to lower case; the matcher folds
+ * the text the same way as it reads it, see categorize().
  */
 static void
 ordinary(p, ch)
@@ -867,13 +856,10 @@ register int ch;
 {
 	register cat_t *cap = p->g->categories;
 
-	if ((p->g->cflags&REG_ICASE) && isalpha(ch) && othercase(ch) != ch)
-		bothcases(p, ch);
-	else {
-		EMIT(OCHAR, (unsigned char)ch);
-		if (cap[ch] == 0)
-			cap[ch] = p->g->ncategories++;
-	}
+	ch = p->g->fold[ch];
+	EMIT(OCHAR, (unsigned char)ch);
+	if (cap[ch] == 0)
+		cap[ch] = p->g->ncategories++;
 }
 
 /*
@@ -1317,6 +1303,11 @@ register struct re_guts *g;
 	if (p->error != 0)
 		return;
 
+	/* a character goes with what it folds to (sets have both cases) */
+	for (c = CHAR_MIN; c <= CHAR_MAX; c++)
+		if (cats[c] == 0 && g->fold[c] != c)
+			cats[c] = cats[(int)g->fold[c]];
+
 	for (c = CHAR_MIN; c <= CHAR_MAX; c++)
 		if (cats[c] == 0 && isinsets(g, c)) {
 			cat = g->ncategories++;
@@ -1564,6 +1555,10 @@ register struct re_guts *g;
 	}
 	assert(cp == g->must + g->mlen);
 	*cp++ = '\0';		/* just on general principles */
+
+	/* literals were folded, so the text has to be as well */
+	if (g->cflags&REG_ICASE)
+		g->iflags |= MUSTFOLD;
 }
 
 /*
@@ -1601,3 +1596,426 @@ register struct re_guts *g;
 		g->iflags |= BAD;
 	return(maxnest);
 }
+
+/*
+ - regmust - find the longest literal string that every match must contain
+ = extern size_t notbuiltin_regmust(const regex_t *, char *, size_t);
+ *
+ * With REG_ICASE the string comes back in lower case.  Like regerror(),
+ * we return the length of the whole string and copy as much of it as
+ * fits; any prefix of the string is just as mandatory as the whole thing.
+ */
+size_t				/* length of string, 0 if there isn't one */
+notbuiltin_regmust(preg, buf, size)
+const regex_t *preg;
+char *buf;
+size_t size;
+{
+	register struct re_guts *g = preg->re_g;
+	register size_t len;
+
+	if (preg->re_magic != MAGIC1 || g->magic != MAGIC2 || g->must == NULL)
+		return(0);
+	if (size > 0) {
+		len = ((size_t)g->mlen < size-1) ? (size_t)g->mlen : size-1;
+		(void) memcpy(buf, g->must, len);
+		buf[len] = '\0';
+	}
+	return((size_t)g->mlen);
+}
+
+/*
+ - findfirst - work out which characters a match can start with
+ == static void findfirst(struct parse *p, register struct re_guts *g);
+ *
+ * Leaves firstmap NULL if a match could start with anything, including
+ * the possibility of an empty match.
+ */
+static void
+findfirst(p, g)
+struct parse *p;
+register struct re_guts *g;
+{
+	register char *seen;
+	register int c;
+
+	/* avoid making error situations worse */
+	if (p->error != 0)
+		return;
+
+	seen = calloc(g->nstates, 1);
+	g->firstmap = calloc(NC, 1);
+	if (seen == NULL || g->firstmap == NULL ||
+			!firstwalk(g, g->firststate+1, g->firstmap, seen)) {
+		free(seen);
+		free(g->firstmap);
+		g->firstmap = NULL;
+		return;
+	}
+	free(seen);
+
+	/* the text isn't folded until the matcher reads it */
+	for (c = CHAR_MIN; c <= CHAR_MAX; c++)
+		if (g->firstmap[(uch)g->fold[c]])
+			g->firstmap[(uch)c] = 1;
+
+	g->nfirst = 0;
+	for (c = 0; c < NC; c++)
+		if (g->firstmap[c]) {
+			if (g->nfirst < 2)
+				g->firstc[g->nfirst] = (char)c;
+			g->nfirst++;
+		}
+	if (g->nfirst == NC) {		/* no help at all */
+		free(g->firstmap);
+		g->firstmap = NULL;
+	}
+}
+
+/*
+ - firstwalk - mark the characters that can come first from here on
+ == static int firstwalk(register struct re_guts *g, sopno pc, uch *map, \
+ ==	char *seen);
+ *
+ * Zero-width things (anchors, parentheses, back references) are passed
+ * over, which can only add characters; that errs on the safe side.
+ */
+static int			/* 0 if anything at all could come first */
+firstwalk(g, pc, map, seen)
+register struct re_guts *g;
+sopno pc;			/* where to start */
+uch *map;			/* mark characters here */
+char *seen;			/* sops already looked at */
+{
+	register sop s;
+	register cset *cs;
+	register int c;
+	register sopno look;
+
+	for (;;) {
+		if (seen[pc])
+			return(1);
+		seen[pc] = 1;
+		s = g->strip[pc];
+		switch (OP(s)) {
+		case OCHAR:
+			map[(uch)OPND(s)] = 1;
+			return(1);
+		case OANYOF:
+			cs = &g->sets[OPND(s)];
+			for (c = CHAR_MIN; c <= CHAR_MAX; c++)
+				if (CHIN(cs, c))
+					map[(uch)c] = 1;
+			return(1);
+		case OANY:
+		case OEND:		/* an empty match */
+			return(0);
+		case OQUEST_:		/* two ways to go */
+		case OCH_:
+			if (!firstwalk(g, pc+OPND(s), map, seen))
+				return(0);
+			pc++;
+			break;
+		case OOR1:		/* done a branch, find the O_CH */
+			for (look = 1; OP(s = g->strip[pc+look]) != O_CH;
+								look += OPND(s))
+				assert(OP(s) == OOR2);
+			pc += look;
+			break;
+		case OOR2:		/* this branch and maybe the next */
+			if (OP(g->strip[pc+OPND(s)]) != O_CH &&
+					!firstwalk(g, pc+OPND(s), map, seen))
+				return(0);
+			pc++;
+			break;
+		default:		/* nothing to match, keep going */
+			pc++;
+			break;
+		}
+	}
+}
+
+/*
+ - findonepass - build the one-pass submatch program, if the RE is one-pass
+ == static void findonepass(struct parse *p, register struct re_guts *g);
+ *
+ * An RE is one-pass if, wherever the matcher is, the next character (or
+ * the end of the match) leaves at most one way to go on.  Then matcher()
+ * can find the subexpressions in one walk along the match instead of
+ * having dissect() take it apart with slow() over and over.  Anchors are
+ * passed over as though they always held, which can only make us give up
+ * more often; once fast() and slow() have found the match there is just
+ * the one path through it.
+ */
+static void
+findonepass(p, g)
+struct parse *p;
+register struct re_guts *g;
+{
+	register struct onepass *o;
+	register sopno pc;
+	register int i;
+	register int c;
+	sopno *pcs;		/* [nnodes] where each node goes on from */
+	int *nodes;		/* [nstates] node each sop leads to, or -1 */
+	int rep[NC];		/* a character in each category, or OUT */
+	char *seen;
+	int *path;
+	int ok;
+
+	/* avoid making error situations worse, and don't bother if no use */
+	if (p->error != 0 || g->backrefs || g->nsub == 0)
+		return;
+
+	o = (struct onepass *)calloc(1, sizeof(struct onepass));
+	pcs = (sopno *)malloc((size_t)(g->nstates+1) * sizeof(sopno));
+	nodes = (int *)malloc((size_t)g->nstates * sizeof(int));
+	seen = malloc((size_t)g->nstates);
+	path = (int *)malloc((size_t)g->nstates * 2 * sizeof(int));
+	ok = (o != NULL && pcs != NULL && nodes != NULL && seen != NULL &&
+								path != NULL);
+
+	/* a node for the start and one after each character */
+	if (ok) {
+		o->nnodes = 1;
+		pcs[0] = g->firststate + 1;
+		for (pc = 0; pc < g->nstates; pc++) {
+			nodes[pc] = -1;
+			switch (OP(g->strip[pc])) {
+			case OCHAR:
+			case OANY:
+			case OANYOF:
+				nodes[pc] = o->nnodes;
+				pcs[o->nnodes++] = pc + 1;
+				break;
+			}
+		}
+		o->ncat = g->ncategories;
+		ok = (o->nnodes * o->ncat <= ONEMAX);
+	}
+	if (ok) {
+		o->next = (int *)malloc((size_t)(o->nnodes * o->ncat) *
+								sizeof(int));
+		o->accept = (int *)malloc((size_t)o->nnodes * sizeof(int));
+		ok = (o->next != NULL && o->accept != NULL);
+	}
+
+	/* find the edges out of each node */
+	if (ok) {
+		for (i = 0; i < o->nnodes * o->ncat; i++)
+			o->next[i] = -1;
+		for (i = 0; i < o->nnodes; i++)
+			o->accept[i] = -1;
+		for (c = 0; c < o->ncat; c++)
+			rep[c] = OUT;
+		for (c = CHAR_MAX; c >= CHAR_MIN; c--)
+			rep[g->categories[c]] = c;
+		for (i = 0; ok && i < o->nnodes; i++) {
+			(void) memset(seen, 0, (size_t)g->nstates);
+			ok = onewalk(g, o, i, pcs[i], nodes, rep, seen, path, 0);
+		}
+	}
+
+	free((char *)pcs);
+	free((char *)nodes);
+	free(seen);
+	free((char *)path);
+	if (!ok) {
+		onefree(o);
+		return;
+	}
+	g->onepass = o;
+}
+
+/*
+ - onewalk - follow each way on from a node to a character or the end
+ == static int onewalk(register struct re_guts *g, register struct onepass *o, \
+ ==	int node, sopno pc, int *nodes, int *rep, char *seen, int *path, \
+ ==	int npath);
+ *
+ * path[0..npath-1] holds the parenthesis actions on the way to pc.  Getting
+ * to a sop twice means two ways through (or an empty loop), and two edges
+ * for one category means the next character doesn't settle it; either way
+ * the RE isn't one-pass.
+ */
+static int			/* 0 if the RE isn't one-pass after all */
+onewalk(g, o, node, pc, nodes, rep, seen, path, npath)
+register struct re_guts *g;
+register struct onepass *o;
+int node;			/* the node we're finding edges for */
+sopno pc;			/* where to start */
+int *nodes;			/* node each sop leads to */
+int *rep;			/* a character in each category */
+char *seen;			/* sops already looked at */
+int *path;
+int npath;
+{
+	register int *np = &o->next[node * o->ncat];
+	register sop s;
+	register cset *cs;
+	register int c;
+	register int e;
+	register sopno look;
+	register int first;
+	register int last;
+
+	for (;;) {
+		if (seen[pc])
+			return(0);
+		seen[pc] = 1;
+		s = g->strip[pc];
+		switch (OP(s)) {
+		case OCHAR:
+		case OANY:
+		case OANYOF:
+			e = oneedge(o, nodes[pc], path, npath);
+			if (e < 0)
+				return(0);
+			cs = (OP(s) == OANYOF) ? &g->sets[OPND(s)] : NULL;
+			for (c = 0; c < o->ncat; c++) {
+				if (OP(s) == OCHAR &&
+					c != g->categories[(int)(char)OPND(s)])
+					continue;
+				if (OP(s) == OANYOF &&
+					(rep[c] == OUT || !CHIN(cs, rep[c])))
+					continue;
+				if (np[c] >= 0)
+					return(0);
+				np[c] = e;
+			}
+			return(1);
+		case OEND:
+			e = oneedge(o, -1, path, npath);
+			if (e < 0)
+				return(0);
+			o->accept[node] = e;
+			return(1);
+		case OBACK_:
+		case O_BACK:
+			return(0);
+		case OLPAREN:
+			path[npath++] = PACT(OPND(s), PSO);
+			pc++;
+			break;
+		case ORPAREN:
+			path[npath++] = PACT(OPND(s), PEO);
+			pc++;
+			break;
+		case O_PLUS:		/* round again, forgetting the last time */
+			look = pc - OPND(s);
+			first = last = 0;
+			for (look++; look < pc; look++)
+				if (OP(g->strip[look]) == OLPAREN) {
+					if (first == 0)
+						first = OPND(g->strip[look]);
+					last = OPND(g->strip[look]);
+				}
+			e = npath;
+			if (first != 0) {
+				path[e++] = PACT(first, PCLR);
+				path[e++] = PACT(last, PCLR);
+			}
+			if (!onewalk(g, o, node, pc - OPND(s) + 1, nodes, rep,
+							seen, path, e))
+				return(0);
+			pc++;
+			break;
+		case OQUEST_:		/* in, or around */
+			if (!onewalk(g, o, node, pc+1, nodes, rep, seen, path,
+									npath))
+				return(0);
+			pc += OPND(s);
+			break;
+		case OCH_:		/* this branch, then the others */
+			if (!onewalk(g, o, node, pc+1, nodes, rep, seen, path,
+									npath))
+				return(0);
+			pc += OPND(s);
+			break;
+		case OOR1:		/* done a branch, find the O_CH */
+			for (look = 1; OP(s = g->strip[pc+look]) != O_CH;
+								look += OPND(s))
+				assert(OP(s) == OOR2);
+			pc += look;
+			break;
+		case OOR2:		/* this branch and maybe the next */
+			if (OP(g->strip[pc+OPND(s)]) != O_CH &&
+					!onewalk(g, o, node, pc+OPND(s), nodes,
+						rep, seen, path, npath))
+				return(0);
+			pc++;
+			break;
+		default:		/* anchors and the like, keep going */
+			pc++;
+			break;
+		}
+	}
+}
+
+/*
+ - oneedge - add an edge to a one-pass program
+ == static int oneedge(register struct onepass *o, int to, int *path, \
+ ==	int npath);
+ */
+static int			/* the new edge, -1 if out of memory */
+oneedge(o, to, path, npath)
+register struct onepass *o;
+int to;				/* node it lands on, -1 for the end */
+int *path;			/* its actions */
+int npath;
+{
+	register int *a;
+	register int n;
+	register int e;
+
+	if (o->nedges == o->maxedges) {
+		n = (o->maxedges == 0) ? 16 : o->maxedges * 2;
+		a = (int *)realloc((char *)o->to, (size_t)n * sizeof(int));
+		if (a == NULL)
+			return(-1);
+		o->to = a;
+		a = (int *)realloc((char *)o->acts, (size_t)(n+1) * sizeof(int));
+		if (a == NULL)
+			return(-1);
+		o->acts = a;
+		o->maxedges = n;
+	}
+	if (o->nact + npath > o->maxact) {
+		n = (o->maxact == 0) ? 16 : o->maxact * 2;
+		if (n < o->nact + npath)
+			n = o->nact + npath;
+		a = (int *)realloc((char *)o->act, (size_t)n * sizeof(int));
+		if (a == NULL)
+			return(-1);
+		o->act = a;
+		o->maxact = n;
+	}
+
+	e = o->nedges++;
+	o->to[e] = to;
+	o->acts[e] = o->nact;
+	if (npath > 0)
+		(void) memcpy((char *)&o->act[o->nact], (char *)path,
+						(size_t)npath * sizeof(int));
+	o->nact += npath;
+	o->acts[e+1] = o->nact;
+	return(e);
+}
+
+/*
+ - onefree - free a one-pass program that didn't work out
+ == static void onefree(register struct onepass *o);
+ */
+static void
+onefree(o)
+register struct onepass *o;
+{
+	if (o == NULL)
+		return;
+	free((char *)o->next);
+	free((char *)o->accept);
+	free((char *)o->to);
+	free((char *)o->acts);
+	free((char *)o->act);
+	free((char *)o);
+}
@@ -27,6 +27,7 @@
  = #define	REG_EMPTY	14
  = #define	REG_ASSERT	15
  = #define	REG_INVARG	16
+ = #define	REG_EBUDGET	17
  = #define	REG_ATOI	255	// convert name to number (!)
  = #define	REG_ITOA	0400	// convert number to name (!)
  */
@@ -52,6 +53,7 @@ static struct rerr {
 	{REG_EMPTY,	"REG_EMPTY",	"empty (sub)expression"},
 	{REG_ASSERT,	"REG_ASSERT",	"\"can't happen\" -- you found a bug"},
 	{REG_INVARG,	"REG_INVARG",	"invalid argument to regex routine"},
+	{REG_EBUDGET,	"REG_EBUDGET",	"matching ran out of steps or time"},
 	{-1,		"",		"*** unknown regexp error code ***"}
 };
 
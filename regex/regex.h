@@ -17,6 +17,7 @@ typedef struct {
 	regoff_t rm_so;		/* start of match */
 	regoff_t rm_eo;		/* end of match */
 } regmatch_t;
+typedef struct re_scratch regscratch_t;
 
 
 /* === regcomp.c === */
@@ -29,6 +30,7 @@ extern int notbuiltin_regcomp(regex_t *, const char *, int);
 #define	REG_NOSPEC	0020
 #define	REG_PEND	0040
 #define	REG_DUMP	0200
+extern size_t notbuiltin_regmust(const regex_t *, char *, size_t);
 
 
 /* === regerror.c === */
@@ -49,6 +51,7 @@ extern int notbuiltin_regcomp(regex_t *, const char *, int);
 #define	REG_EMPTY	14
 #define	REG_ASSERT	15
 #define	REG_INVARG	16
+#define	REG_EBUDGET	17
 #define	REG_ATOI	255	/* convert name to number (!) */
 #define	REG_ITOA	0400	/* convert number to name (!) */
 extern size_t notbuiltin_regerror(int, const regex_t *, char *, size_t);
@@ -62,6 +65,12 @@ extern int notbuiltin_regexec(const regex_t *, const char *, size_t, regmatch_t
 #define	REG_TRACE	00400	/* tracing of execution */
 #define	REG_LARGE	01000	/* force large representation */
 #define	REG_BACKR	02000	/* force use of backref code */
+extern int notbuiltin_regexec_scratch(const regex_t *, const char *, size_t, regmatch_t [], int, regscratch_t *);
+extern int notbuiltin_regnexec(const regex_t *, const char *, size_t, size_t, regmatch_t [], int, regscratch_t *);
+extern regscratch_t *notbuiltin_regscratch_alloc(void);
+extern void notbuiltin_regscratch_free(regscratch_t *);
+extern void notbuiltin_regscratch_budget(regscratch_t *, long, long);
+extern int notbuiltin_regscratch_spend(regscratch_t *, long);
 
 
 /* === regfree.c === */
@@ -11,6 +11,7 @@
  = 	regoff_t rm_so;		// start of match
  = 	regoff_t rm_eo;		// end of match
  = } regmatch_t;
+ = typedef struct re_scratch regscratch_t;
  */
 /*
  * internals of regex_t
@@ -97,6 +98,34 @@ typedef struct {
 /* stuff for character categories */
 typedef unsigned char cat_t;
 
+/*
+ * one-pass submatch program, see findonepass().  A node is somewhere the
+ * matcher can be between characters: the start, or just after a sop that
+ * matches a character.  From a node, each character category (or the end
+ * of the match) leaves at most one edge to take; an edge does its
+ * parenthesis actions and lands on another node.
+ */
+struct onepass {
+	int nnodes;		/* node 0 is the start */
+	int ncat;		/* copy of g->ncategories */
+	int *next;		/* [nnodes][ncat] edge to take, -1 none */
+	int *accept;		/* [nnodes] edge to the end, -1 none */
+	int nedges;
+	int *to;		/* [nedges] node an edge lands on */
+	int *acts;		/* [nedges+1] where its actions start in act */
+	int *act;		/* actions, see PACT() */
+	int nact;
+	int maxedges;		/* room in to and acts */
+	int maxact;		/* room in act */
+};
+#define	PSO	0		/* start of subexpression here */
+#define	PEO	1		/* end of subexpression here */
+#define	PCLR	2		/* forget subexpressions, next act is the last */
+#define	PACT(i, what)	((int)(i)<<2 | (what))
+#define	PSUB(a)		((a)>>2)
+#define	PWHAT(a)	((a)&03)
+#define	ONEMAX		(16*1024)	/* biggest nnodes*ncat we'll build */
+
 /*
  * main compiled-expression structure
  */
@@ -116,19 +145,76 @@ struct re_guts {
 #		define	USEBOL	01	/* used ^ */
 #		define	USEEOL	02	/* used $ */
 #		define	BAD	04	/* something wrong */
+#		define	MUSTFOLD 010	/* must is lower case, ignore case */
 	int nbol;		/* number of ^ used */
 	int neol;		/* number of $ used */
 	int ncategories;	/* how many character categories */
 	cat_t *categories;	/* ->catspace[-CHAR_MIN] */
 	char *must;		/* match must contain this string */
 	int mlen;		/* length of must */
+	uch *firstmap;		/* [NC] chars a match can start with, or NULL */
+	int nfirst;		/* how many there are */
+	char firstc[2];		/* the first two of them */
+	struct onepass *onepass;	/* NULL unless it's one-pass */
 	size_t nsub;		/* copy of re_nsub */
 	int backrefs;		/* does it use back references? */
 	sopno nplus;		/* how deep does it nest +s? */
+	unsigned long serial;	/* tells apart REs that reuse an address */
+	char *fold;		/* ->foldspace[-CHAR_MIN] */
+	char foldspace[NC];	/* text char -> what literals hold */
 	/* catspace must be last */
 	cat_t catspace[1];	/* actually [NC] */
 };
 
+/*
+ * lazily built DFA for one RE, see fast().  A DFA state is a set of
+ * strip states; transitions are filled in as the text needs them and
+ * the whole thing is thrown away when it fills up.
+ */
+struct re_dfa {
+	struct re_guts *g;	/* the RE this is for, NULL if unused */
+	unsigned long serial;	/* copy of g->serial */
+	size_t ssize;		/* bytes in a set of strip states */
+	int ncat;		/* copy of g->ncategories */
+	int nd;			/* DFA states in use */
+	int maxd;		/* DFA states we have room for */
+	int nflush;		/* times we ran out of room */
+	char *sets;		/* [maxd][ssize] strip states of each */
+	int *next;		/* [maxd][ncat] transitions, -1 unknown */
+	char *flags;		/* [maxd] */
+#		define	DACCEPT	01	/* the stop state is in the set */
+#		define	DFRESH	02	/* same as a fresh start */
+	int *hash;		/* [nhash] chains of states by set */
+	int *chain;		/* [maxd] */
+	int nhash;		/* a power of two */
+};
+#define	DFASPACE	(64*1024)	/* bytes each DFA may use */
+#define	DFAMIN		16		/* fewer states than this isn't worth it */
+#define	NDFA		8		/* DFAs kept in one scratch */
+
+/*
+ * scratch space for the matching engine, owned by the caller so that
+ * repeated matching need not go to malloc every time
+ */
+struct re_scratch {
+	char *space;		/* state vectors for the large version */
+	size_t nspace;		/* bytes allocated at space */
+	regmatch_t *pmatch;	/* subexpression matches while dissecting */
+	size_t npmatch;		/* bytes allocated at pmatch */
+	char **lastpos;		/* PLUS positions for backref */
+	size_t nlastpos;	/* bytes allocated at lastpos */
+	struct re_dfa dfa[NDFA];	/* DFAs of recently used REs */
+	int dfanext;		/* which one to reuse next */
+	int nodfa;		/* thrown away after one match, not worth a DFA */
+	int budgeted;		/* is there any limit, see regscratch_budget() */
+	long steps;		/* steps left, -1 if not counting */
+	int timed;		/* is there a deadline? */
+	double deadline;	/* when, see now() */
+	long tick;		/* steps since we last looked at the clock */
+	int over;		/* ran out, until the next budget */
+};
+#define	TICKS		1024	/* steps between looks at the clock */
+
 /* misc utilities */
 #define	OUT	(CHAR_MAX+1)	/* a non-character value */
 #define	ISWORD(c)	(isalnum(c) || (c) == '_')
@@ -1,9 +1,10 @@
 /*
  * the outer shell of regexec()
  *
- * This file includes engine.c *twice*, after muchos fiddling with the
- * macros that code uses.  This lets the same code operate on two different
- * representations for state sets.
+ * This file includes engine.c four times, after muchos fiddling with the
+ * macros that code uses.  This lets the same code operate on different
+ * representations for state sets: one bit per state in an unsigned, a
+ * 64-bit word or a few words, and one byte per state for the big ones.
  */
 #include <sys/types.h>
 #include <stdio.h>
@@ -11,6 +12,13 @@
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <regex.h>
 
 #include "utils.h"
@@ -18,6 +26,297 @@
 
 static int nope = 0;		/* for use in asserts; shuts lint up */
 
+/*
+ - regrow - make sure a scratch area has room for at least need bytes
+ */
+static int			/* 0 success, REG_ESPACE failure */
+regrow(area, have, need)
+void **area;
+size_t *have;
+size_t need;
+{
+	register void *p;
+
+	if (*have >= need)
+		return(0);
+	p = realloc(*area, need);
+	if (p == NULL)
+		return(REG_ESPACE);
+	*area = p;
+	*have = need;
+	return(0);
+}
+#define	GROW(a, have, n)	regrow((void **)&(a), &(have), (n) * sizeof(*(a)))
+
+/*
+ - now - seconds on a clock that doesn't jump about
+ */
+static double
+now()
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+/*
+ - spend - charge steps to a scratch's budget
+ */
+static int			/* nonzero if the budget has run out */
+spend(sc, n)
+register struct re_scratch *sc;
+long n;
+{
+	if (sc->over)
+		return(1);
+	if (sc->steps >= 0) {
+		sc->steps -= n;
+		if (sc->steps < 0)
+			sc->over = 1;
+	}
+	if (sc->timed) {
+		sc->tick += n;
+		if (sc->tick >= TICKS) {
+			sc->tick = 0;
+			if (now() >= sc->deadline)
+				sc->over = 1;
+		}
+	}
+	return(sc->over);
+}
+/* a step in the matcher; does it take us over budget? */
+#define	SPEND(m)	((m)->scratch->budgeted && spend((m)->scratch, 1L))
+#define	OVER(m)		((m)->scratch->over)
+
+/*
+ - mustat - is g->must at p?
+ */
+static int
+mustat(g, p)
+register struct re_guts *g;
+register char *p;
+{
+	register int i;
+
+	if (!(g->iflags&MUSTFOLD))
+		return(memcmp(p, g->must, (size_t)g->mlen) == 0);
+	for (i = 0; i < g->mlen; i++)
+		if (tolower((uch)p[i]) != (uch)g->must[i])
+			return(0);
+	return(1);
+}
+
+/*
+ - mustfind - find g->must in a string, ignoring case if it was folded
+ *
+ * Candidates are places where both the first and the last character of
+ * must turn up the right distance apart, sixteen at a time with SSE2.
+ */
+static char *			/* where it starts, or NULL */
+mustfind(g, start, stop)
+register struct re_guts *g;
+char *start;
+char *stop;
+{
+	register char *p = start;
+	register char *end = stop - g->mlen;	/* last place it could start */
+	register int fold = g->iflags&MUSTFOLD;
+	register int f1 = (uch)g->must[0];
+	register int l1 = (uch)g->must[g->mlen-1];
+	register int f2 = (fold) ? toupper(f1) : f1;
+	register int l2 = (fold) ? toupper(l1) : l1;
+	register int i;
+#ifdef __SSE2__
+	__m128i F1 = _mm_set1_epi8((char)f1), F2 = _mm_set1_epi8((char)f2);
+	__m128i L1 = _mm_set1_epi8((char)l1), L2 = _mm_set1_epi8((char)l2);
+	__m128i a, b;
+	register unsigned bits;
+#endif
+
+	if (stop - start < g->mlen)
+		return(NULL);
+#ifdef __SSE2__
+	for (; end - p >= 15; p += 16) {
+		a = _mm_loadu_si128((__m128i *)p);
+		b = _mm_loadu_si128((__m128i *)(p + g->mlen - 1));
+		bits = _mm_movemask_epi8(_mm_and_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(a, F1), _mm_cmpeq_epi8(a, F2)),
+			_mm_or_si128(_mm_cmpeq_epi8(b, L1), _mm_cmpeq_epi8(b, L2))));
+		for (i = 0; bits != 0; i++, bits >>= 1)
+			if ((bits&1) && mustat(g, p + i))
+				return(p + i);
+	}
+#endif
+	for (; p <= end; p++)
+		if (((uch)*p == f1 || (uch)*p == f2) && mustat(g, p))
+			return(p);
+	return(NULL);
+}
+
+/*
+ - firstskip - skip to the next character that could start a match
+ */
+static char *			/* stop if there is none */
+firstskip(g, start, stop)
+register struct re_guts *g;
+char *start;
+char *stop;
+{
+	register char *p = start;
+	register uch *map = g->firstmap;
+#ifdef __SSE2__
+	__m128i C1 = _mm_set1_epi8(g->firstc[0]);
+	__m128i C2 = _mm_set1_epi8(g->firstc[g->nfirst > 1]);
+	__m128i a;
+	register unsigned bits;
+	register int i;
+
+	if (g->nfirst <= 2)
+		for (; stop - p >= 16; p += 16) {
+			a = _mm_loadu_si128((__m128i *)p);
+			bits = _mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(a, C1), _mm_cmpeq_epi8(a, C2)));
+			if (bits != 0) {
+				for (i = 0; !(bits&1); i++, bits >>= 1)
+					continue;
+				return(p + i);
+			}
+		}
+#endif
+	while (p < stop && !map[(uch)*p])
+		p++;
+	return(p);
+}
+
+/*
+ - dfafree - release a DFA's tables and mark it unused
+ */
+static void
+dfafree(d)
+register struct re_dfa *d;
+{
+	free(d->sets);
+	free((char *)d->next);
+	free(d->flags);
+	free((char *)d->hash);
+	free((char *)d->chain);
+	memset((char *)d, 0, sizeof(*d));
+}
+
+/*
+ - scratchfree - release everything hanging off a scratch space
+ */
+static void
+scratchfree(sc)
+register struct re_scratch *sc;
+{
+	register int i;
+
+	free(sc->space);
+	free((char *)sc->pmatch);
+	free((char *)sc->lastpos);
+	for (i = 0; i < NDFA; i++)
+		dfafree(&sc->dfa[i]);
+}
+
+/*
+ - dfaget - find or set up the DFA for an RE in a scratch space
+ *
+ * Only REs without ^ $ and word boundaries qualify, since then the
+ * next set of states depends on nothing but the current set and the
+ * character's category.
+ */
+static struct re_dfa *		/* NULL if the RE can't have one */
+dfaget(sc, g, ssize)
+register struct re_scratch *sc;
+register struct re_guts *g;
+size_t ssize;			/* bytes in a set of strip states */
+{
+	register struct re_dfa *d;
+	register sopno pc;
+	register int i;
+	register size_t each;
+
+	for (i = 0; i < NDFA; i++)
+		if (sc->dfa[i].g == g && sc->dfa[i].serial == g->serial &&
+						sc->dfa[i].ssize == ssize)
+			return(&sc->dfa[i]);
+
+	if (g->nbol > 0 || g->neol > 0 || g->ncategories > UCHAR_MAX+1)
+		return(NULL);
+	for (pc = g->firststate; pc < g->laststate; pc++)
+		if (OP(g->strip[pc]) == OBOW || OP(g->strip[pc]) == OEOW)
+			return(NULL);
+	each = ssize + g->ncategories*sizeof(int) + 1 + 2*sizeof(int);
+	if (DFASPACE / each < DFAMIN)
+		return(NULL);
+
+	d = &sc->dfa[sc->dfanext];
+	sc->dfanext = (sc->dfanext + 1) % NDFA;
+	dfafree(d);
+	d->maxd = DFASPACE / each;
+	for (d->nhash = 1; d->nhash < d->maxd; d->nhash <<= 1)
+		continue;
+	d->sets = malloc(d->maxd * ssize);
+	d->next = (int *)malloc(d->maxd * g->ncategories * sizeof(int));
+	d->flags = malloc(d->maxd);
+	d->hash = (int *)malloc(d->nhash * sizeof(int));
+	d->chain = (int *)malloc(d->maxd * sizeof(int));
+	if (d->sets == NULL || d->next == NULL || d->flags == NULL ||
+					d->hash == NULL || d->chain == NULL) {
+		dfafree(d);
+		return(NULL);
+	}
+	d->g = g;
+	d->serial = g->serial;
+	d->ssize = ssize;
+	d->ncat = g->ncategories;
+	d->nd = 0;
+	for (i = 0; i < d->nhash; i++)
+		d->hash[i] = -1;
+	return(d);
+}
+
+/*
+ - dfastate - find the DFA state for a set of strip states, adding it if new
+ *
+ * If the DFA is full it is emptied first, which invalidates every state
+ * number handed out before; callers can tell by watching nflush.
+ */
+static int			/* DFA state number */
+dfastate(d, set, flags)
+register struct re_dfa *d;
+char *set;
+int flags;
+{
+	register unsigned long h = 0;
+	register size_t i;
+	register int ds;
+
+	for (i = 0; i < d->ssize; i++)
+		h = h*31 + (unsigned char)set[i];
+	h &= d->nhash - 1;
+	for (ds = d->hash[h]; ds >= 0; ds = d->chain[ds])
+		if (memcmp(d->sets + ds*d->ssize, set, d->ssize) == 0)
+			return(ds);
+
+	if (d->nd == d->maxd) {
+		for (i = 0; i < d->nhash; i++)
+			d->hash[i] = -1;
+		d->nd = 0;
+		d->nflush++;
+	}
+	ds = d->nd++;
+	memcpy(d->sets + ds*d->ssize, set, d->ssize);
+	for (i = 0; i < d->ncat; i++)
+		d->next[ds*d->ncat + i] = -1;
+	d->flags[ds] = flags;
+	d->chain[ds] = d->hash[h];
+	d->hash[h] = ds;
+	return(ds);
+}
+
 /* macros for manipulating states, small version */
 #define	states	unsigned
 #define	states1	unsigned	/* for later use in regexec() decision */
@@ -40,6 +339,10 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #define	FWD(dst, src, n)	((dst) |= ((unsigned)(src)&(here)) << (n))
 #define	BACK(dst, src, n)	((dst) |= ((unsigned)(src)&(here)) >> (n))
 #define	ISSETBACK(v, n)	((v) & ((unsigned)here >> (n)))
+/* state sets as bytes, for the lazy DFA */
+#define	SETSIZE(m)	sizeof(unsigned)
+#define	SETBYTES(v)	((char *)&(v))
+#define	LOADSET(v, b)	memcpy((char *)&(v), (b), sizeof(unsigned))
 /* function names */
 #define SNAMES			/* engine.c looks after details */
 
@@ -64,8 +367,153 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #undef	FWD
 #undef	BACK
 #undef	ISSETBACK
+#undef	SETSIZE
+#undef	SETBYTES
+#undef	LOADSET
 #undef	SNAMES
 
+/* macros for manipulating states, 64-bit version */
+#define	states	uint64_t
+#define	QSTATES	64		/* for later use in regexec() decision */
+#define	CLEAR(v)	((v) = 0)
+#define	SET0(v, n)	((v) &= ~((uint64_t)1 << (n)))
+#define	SET1(v, n)	((v) |= (uint64_t)1 << (n))
+#define	ISSET(v, n)	((v) & ((uint64_t)1 << (n)))
+#define	ASSIGN(d, s)	((d) = (s))
+#define	EQ(a, b)	((a) == (b))
+#define	STATEVARS	int dummy	/* dummy version */
+#define	STATESETUP(m, n)	/* nothing */
+#define	STATETEARDOWN(m)	/* nothing */
+#define	SETUP(v)	((v) = 0)
+#define	onestate	uint64_t
+#define	INIT(o, n)	((o) = (uint64_t)1 << (n))
+#define	INC(o)	((o) <<= 1)
+#define	ISSTATEIN(v, o)	((v) & (o))
+/* some abbreviations; note that some of these know variable names! */
+/* do "if I'm here, I can also be there" etc without branches */
+#define	FWD(dst, src, n)	((dst) |= ((uint64_t)(src)&(here)) << (n))
+#define	BACK(dst, src, n)	((dst) |= ((uint64_t)(src)&(here)) >> (n))
+#define	ISSETBACK(v, n)	((v) & ((uint64_t)here >> (n)))
+/* state sets as bytes, for the lazy DFA */
+#define	SETSIZE(m)	sizeof(uint64_t)
+#define	SETBYTES(v)	((char *)&(v))
+#define	LOADSET(v, b)	memcpy((char *)&(v), (b), sizeof(uint64_t))
+/* function names */
+#define	QNAMES			/* flag */
+
+#include "engine.c"
+
+#undef	states
+#undef	CLEAR
+#undef	SET0
+#undef	SET1
+#undef	ISSET
+#undef	ASSIGN
+#undef	EQ
+#undef	STATEVARS
+#undef	STATESETUP
+#undef	STATETEARDOWN
+#undef	SETUP
+#undef	onestate
+#undef	INIT
+#undef	INC
+#undef	ISSTATEIN
+#undef	FWD
+#undef	BACK
+#undef	ISSETBACK
+#undef	SETSIZE
+#undef	SETBYTES
+#undef	LOADSET
+#undef	QNAMES
+
+/*
+ * Wide version: a fixed number of 64-bit words, one bit per state, so
+ * copying and comparing sets is a couple of vector instructions rather
+ * than a memcpy()/memcmp() of one byte per state.
+ */
+#define	WWORDS	4		/* words in a set */
+#define	WSTATES	(WWORDS*64)	/* for later use in regexec() decision */
+#define	WBYTES	(WWORDS*sizeof(uint64_t))
+#if defined(__AVX2__)
+#define	WCLEAR(v)	_mm256_storeu_si256((__m256i *)(v), _mm256_setzero_si256())
+#define	WASSIGN(d, s)	_mm256_storeu_si256((__m256i *)(d), \
+				_mm256_loadu_si256((__m256i *)(s)))
+#define	WEQ(a, b)	(_mm256_movemask_epi8(_mm256_cmpeq_epi8( \
+				_mm256_loadu_si256((__m256i *)(a)), \
+				_mm256_loadu_si256((__m256i *)(b)))) == -1)
+#elif defined(__SSE2__)
+#define	WCLEAR(v)	(_mm_storeu_si128((__m128i *)(v), _mm_setzero_si128()), \
+			_mm_storeu_si128((__m128i *)(v)+1, _mm_setzero_si128()))
+#define	WASSIGN(d, s)	(_mm_storeu_si128((__m128i *)(d), \
+				_mm_loadu_si128((__m128i *)(s))), \
+			_mm_storeu_si128((__m128i *)(d)+1, \
+				_mm_loadu_si128((__m128i *)(s)+1)))
+#define	WEQ(a, b)	(_mm_movemask_epi8(_mm_and_si128( \
+			_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(a)), \
+				_mm_loadu_si128((__m128i *)(b))), \
+			_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(a)+1), \
+				_mm_loadu_si128((__m128i *)(b)+1)))) == 0xffff)
+#else
+#define	WCLEAR(v)	memset((char *)(v), 0, WBYTES)
+#define	WASSIGN(d, s)	memcpy((char *)(d), (char *)(s), WBYTES)
+#define	WEQ(a, b)	(memcmp((char *)(a), (char *)(b), WBYTES) == 0)
+#endif
+#define	states	uint64_t *
+#define	CLEAR(v)	WCLEAR(v)
+#define	SET0(v, n)	((v)[(n)>>6] &= ~((uint64_t)1 << ((n)&63)))
+#define	SET1(v, n)	((v)[(n)>>6] |= (uint64_t)1 << ((n)&63))
+#define	ISSET(v, n)	(((v)[(n)>>6] >> ((n)&63)) & 1)
+#define	ASSIGN(d, s)	WASSIGN(d, s)
+#define	EQ(a, b)	WEQ(a, b)
+#define	STATEVARS	int vn; char *space
+#define	STATESETUP(m, nv)	{ if (regrow((void **)&(m)->scratch->space, \
+				&(m)->scratch->nspace, (nv)*WBYTES) != 0) \
+					return(REG_ESPACE); \
+				(m)->space = (m)->scratch->space; (m)->vn = 0; }
+#define	STATETEARDOWN(m)	/* space belongs to the scratch */
+#define	SETUP(v)	((v) = (uint64_t *)&m->space[m->vn++ * WBYTES])
+#define	onestate	int
+#define	INIT(o, n)	((o) = (n))
+#define	INC(o)	((o)++)
+#define	ISSTATEIN(v, o)	ISSET(v, o)
+/* some abbreviations; note that some of these know variable names! */
+#define	FWD(dst, src, n)	((dst)[(here+(n))>>6] |= \
+				ISSET(src, here) << ((here+(n))&63))
+#define	BACK(dst, src, n)	((dst)[(here-(n))>>6] |= \
+				ISSET(src, here) << ((here-(n))&63))
+#define	ISSETBACK(v, n)	ISSET(v, here - (n))
+/* state sets as bytes, for the lazy DFA */
+#define	SETSIZE(m)	WBYTES
+#define	SETBYTES(v)	((char *)(v))
+#define	LOADSET(v, b)	memcpy((char *)(v), (b), WBYTES)
+/* function names */
+#define	WNAMES			/* flag */
+
+#include "engine.c"
+
+#undef	states
+#undef	CLEAR
+#undef	SET0
+#undef	SET1
+#undef	ISSET
+#undef	ASSIGN
+#undef	EQ
+#undef	STATEVARS
+#undef	STATESETUP
+#undef	STATETEARDOWN
+#undef	SETUP
+#undef	onestate
+#undef	INIT
+#undef	INC
+#undef	ISSTATEIN
+#undef	FWD
+#undef	BACK
+#undef	ISSETBACK
+#undef	SETSIZE
+#undef	SETBYTES
+#undef	LOADSET
+#undef	WNAMES
+
 /* macros for manipulating states, large version */
 #define	states	char *
 #define	CLEAR(v)	memset(v, 0, m->g->nstates)
@@ -75,10 +523,11 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #define	ASSIGN(d, s)	memcpy(d, s, m->g->nstates)
 #define	EQ(a, b)	(memcmp(a, b, m->g->nstates) == 0)
 #define	STATEVARS	int vn; char *space
-#define	STATESETUP(m, nv)	{ (m)->space = malloc((nv)*(m)->g->nstates); \
-				if ((m)->space == NULL) return(REG_ESPACE); \
-				(m)->vn = 0; }
-#define	STATETEARDOWN(m)	{ free((m)->space); }
+#define	STATESETUP(m, nv)	{ if (regrow((void **)&(m)->scratch->space, \
+				&(m)->scratch->nspace, (nv)*(m)->g->nstates) != 0) \
+					return(REG_ESPACE); \
+				(m)->space = (m)->scratch->space; (m)->vn = 0; }
+#define	STATETEARDOWN(m)	/* space belongs to the scratch */
 #define	SETUP(v)	((v) = &m->space[m->vn++ * m->g->nstates])
 #define	onestate	int
 #define	INIT(o, n)	((o) = (n))
@@ -89,6 +538,10 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
 #define	FWD(dst, src, n)	((dst)[here+(n)] |= (src)[here])
 #define	BACK(dst, src, n)	((dst)[here-(n)] |= (src)[here])
 #define	ISSETBACK(v, n)	((v)[here - (n)])
+/* state sets as bytes, for the lazy DFA */
+#define	SETSIZE(m)	((size_t)(m)->g->nstates)
+#define	SETBYTES(v)	(v)
+#define	LOADSET(v, b)	memcpy((v), (b), m->g->nstates)
 /* function names */
 #define	LNAMES			/* flag */
 
@@ -105,19 +558,78 @@ static int nope = 0;		/* for use in asserts; shuts lint up */
  = #define	REG_LARGE	01000	// force large representation
  = #define	REG_BACKR	02000	// force use of backref code
  *
+ * This one uses scratch space of its own, which costs a few mallocs
+ * per call and never gets a lazy DFA, since the DFA would be thrown
+ * away with it; see regexec_scratch() for the alternative.
+ */
+int				/* 0 success, REG_NOMATCH failure */
+notbuiltin_regexec(preg, string, nmatch, pmatch, eflags)
+const regex_t *preg;
+const char *string;
+size_t nmatch;
+regmatch_t pmatch[];
+int eflags;
+{
+	struct re_scratch sc;
+	register int ret;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.nodfa = 1;		/* building one would cost more than it saves */
+	ret = notbuiltin_regexec_scratch(preg, string, nmatch, pmatch, eflags,
+									&sc);
+	scratchfree(&sc);
+	return(ret);
+}
+
+/*
+ - regexec_scratch - regexec() using caller-owned scratch space
+ = extern int notbuiltin_regexec_scratch(const regex_t *, const char *, \
+ =				size_t, regmatch_t [], int, regscratch_t *);
+ *
+ * The scratch grows to fit the largest expression it has been used
+ * with and is then reused, so once it is warm a match does no heap
+ * allocation at all.  A scratch must not be used by two matches at
+ * once, but it may be shared by any number of compiled expressions.
+ */
+int				/* 0 success, REG_NOMATCH or REG_EBUDGET failure */
+notbuiltin_regexec_scratch(preg, string, nmatch, pmatch, eflags, sc)
+const regex_t *preg;
+const char *string;
+size_t nmatch;
+regmatch_t pmatch[];
+int eflags;
+regscratch_t *sc;
+{
+	return(notbuiltin_regnexec(preg, string,
+			(eflags&REG_STARTEND) ? 0 : strlen(string),
+			nmatch, pmatch, eflags, sc));
+}
+
+/*
+ - regnexec - regexec_scratch() on a string whose length we know
+ = extern int notbuiltin_regnexec(const regex_t *, const char *, size_t, \
+ =			size_t, regmatch_t [], int, regscratch_t *);
+ *
+ * The string runs for len characters and need not be NUL-terminated,
+ * which saves a strlen() per call when the caller already knows the
+ * length.  REG_STARTEND still works, and then len is ignored.
+ *
  * We put this here so we can exploit knowledge of the state representation
  * when choosing which matcher to call.  Also, by this point the matchers
  * have been prototyped.
  */
-int				/* 0 success, REG_NOMATCH failure */
-notbuiltin_regexec(preg, string, nmatch, pmatch, eflags)
+int				/* 0 success, REG_NOMATCH or REG_EBUDGET failure */
+notbuiltin_regnexec(preg, string, len, nmatch, pmatch, eflags, sc)
 const regex_t *preg;
 const char *string;
+size_t len;
 size_t nmatch;
 regmatch_t pmatch[];
 int eflags;
+regscratch_t *sc;
 {
 	register struct re_guts *g = preg->re_g;
+	register char *str = (char *)string;
 #ifdef REDEBUG
 #	define	GOODFLAGS(f)	(f)
 #else
@@ -130,9 +642,81 @@ int eflags;
 	if (g->iflags&BAD)		/* backstop for no-debug case */
 		return(REG_BADPAT);
 	eflags = GOODFLAGS(eflags);
+	if (sc->over)
+		return(REG_EBUDGET);
 
-	if (g->nstates <= CHAR_BIT*sizeof(states1) && !(eflags&REG_LARGE))
-		return(smatcher(g, (char *)string, nmatch, pmatch, eflags));
+	if (eflags&REG_LARGE)
+		return(lmatcher(g, str, len, nmatch, pmatch, eflags, sc));
+	else if (g->nstates <= CHAR_BIT*sizeof(states1))
+		return(smatcher(g, str, len, nmatch, pmatch, eflags, sc));
+	else if (g->nstates <= QSTATES)
+		return(qmatcher(g, str, len, nmatch, pmatch, eflags, sc));
+	else if (g->nstates <= WSTATES)
+		return(wmatcher(g, str, len, nmatch, pmatch, eflags, sc));
 	else
-		return(lmatcher(g, (char *)string, nmatch, pmatch, eflags));
+		return(lmatcher(g, str, len, nmatch, pmatch, eflags, sc));
+}
+
+/*
+ - regscratch_alloc - get an empty scratch space for regexec_scratch()
+ = extern regscratch_t *notbuiltin_regscratch_alloc(void);
+ */
+regscratch_t *			/* NULL if out of memory */
+notbuiltin_regscratch_alloc()
+{
+	return((regscratch_t *)calloc(1, sizeof(regscratch_t)));
+}
+
+/*
+ - regscratch_free - free a scratch space and everything in it
+ = extern void notbuiltin_regscratch_free(regscratch_t *);
+ */
+void
+notbuiltin_regscratch_free(sc)
+regscratch_t *sc;
+{
+	if (sc == NULL)
+		return;
+	scratchfree(sc);
+	free((char *)sc);
+}
+
+/*
+ - regscratch_budget - limit how much work matches using a scratch may do
+ = extern void notbuiltin_regscratch_budget(regscratch_t *, long, long);
+ *
+ * From now on the parts of the matcher that back references and
+ * pathological REs make slow give up with REG_EBUDGET once they have
+ * taken steps steps between them, or once msec milliseconds have passed;
+ * 0 means no limit of that kind.  The budget covers every match done with
+ * the scratch until the next call here, so it can cover a batch of them.
+ */
+void
+notbuiltin_regscratch_budget(sc, steps, msec)
+regscratch_t *sc;
+long steps;
+long msec;
+{
+	sc->steps = (steps > 0) ? steps : -1;
+	sc->timed = (msec > 0);
+	if (sc->timed)
+		sc->deadline = now() + (double)msec / 1000.0;
+	sc->tick = 0;
+	sc->over = 0;
+	sc->budgeted = (sc->steps >= 0 || sc->timed);
+}
+
+/*
+ - regscratch_spend - charge work done outside the matcher to a budget
+ = extern int notbuiltin_regscratch_spend(regscratch_t *, long);
+ *
+ * For callers whose own work between matches should count against the
+ * same budget.
+ */
+int				/* nonzero if the budget has run out */
+notbuiltin_regscratch_spend(sc, n)
+regscratch_t *sc;
+long n;
+{
+	return(sc->budgeted && spend(sc, n));
 }
@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <regex.h>
 
 #include "utils.h"
@@ -33,5 +34,15 @@ regex_t *preg;
 		free((char *)g->setbits);
 	if (g->must != NULL)
 		free(g->must);
+	if (g->firstmap != NULL)
+		free((char *)g->firstmap);
+	if (g->onepass != NULL) {
+		free((char *)g->onepass->next);
+		free((char *)g->onepass->accept);
+		free((char *)g->onepass->to);
+		free((char *)g->onepass->acts);
+		free((char *)g->onepass->act);
+		free((char *)g->onepass);
+	}
 	free((char *)g);
 }
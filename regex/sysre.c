@@ -0,0 +1,68 @@
+/*
+ * The system's own regcomp/regexec, for comparison in re -b -s.  This file
+ * is compiled without -I., so <regex.h> here is the system's, and nothing
+ * of its regex_t or flag values leaks into main.c.
+ */
+#include <stdlib.h>
+#include <sys/types.h>
+#include <regex.h>
+
+/*
+ - sysre_comp - compile with the system regcomp, NULL if it won't
+ = void *sysre_comp(char *pat, int ext, int icase, int nosub, int newline);
+ */
+void *
+sysre_comp(pat, ext, icase, nosub, newline)
+char *pat;
+int ext;
+int icase;
+int nosub;
+int newline;
+{
+	regex_t *re;
+	int flags = 0;
+
+	re = (regex_t *)malloc(sizeof(regex_t));
+	if (re == NULL)
+		return(NULL);
+	if (ext)
+		flags |= REG_EXTENDED;
+	if (icase)
+		flags |= REG_ICASE;
+	if (nosub)
+		flags |= REG_NOSUB;
+	if (newline)
+		flags |= REG_NEWLINE;
+	if (regcomp(re, pat, flags) != 0) {
+		free((char *)re);
+		return(NULL);
+	}
+	return((void *)re);
+}
+
+/*
+ - sysre_exec - run the system regexec, asking for nsub submatches
+ = int sysre_exec(void *re, char *str, int nsub);
+ */
+int				/* 0 match, nonzero no match */
+sysre_exec(re, str, nsub)
+void *re;
+char *str;
+int nsub;			/* at most 10 */
+{
+	regmatch_t subs[10];
+
+	return(regexec((regex_t *)re, str, (size_t)nsub, subs, 0));
+}
+
+/*
+ - sysre_free - release something from sysre_comp
+ = void sysre_free(void *re);
+ */
+void
+sysre_free(re)
+void *re;
+{
+	regfree((regex_t *)re);
+	free((char *)re);
+}
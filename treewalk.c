@@ -0,0 +1,235 @@
+/* treewalk.c - Tree expression matcher, for any kind of tree
+ + Copyright (C) 2005 Dell, Inc.
+ + Authors: David Barksdale <amatus@ocgnet.org>
+ +
+ +  This library is free software; you can redistribute it and/or
+ +  modify it under the terms of the GNU Lesser General Public
+ +  License as published by the Free Software Foundation; either
+ +  version 2.1 of the License, or (at your option) any later version.
+ +
+ +  This library is distributed in the hope that it will be useful,
+ +  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ +  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ +  Lesser General Public License for more details.
+ +
+ +  You should have received a copy of the GNU Lesser General Public
+ +  License along with this library; if not, write to the Free Software
+ +  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * This file is #included by treexpr.c once for each kind of tree we can run over, after
+ * #defines of the macros below, so each kind gets a matcher of it's own without going through
+ * function pointers for every step. Afterwards the macros are #undefed again.
+ *
+ * PUSH_FRAME, TREE_PROCESS, NODE_PROCESS, ATTRS_PROCESS	names of the functions
+ * NODE						pointer to a node, NULL for none
+ * NAME_OK( ctx, tr, n )		does transition tr's name match node n
+ * CHILDREN( ctx, n ), NEXT( ctx, n )	first child and next sibling of n
+ * CONTENT( ctx, n )			contents of n (char *), NULL for none
+ * CONTENT_LEN( ctx, n )		their length, or NOLEN if we'd have to work it out
+ * FIND_ATTR( ctx, n, attr, v, l )	finds n's attribute named like struct attribute attr and
+ *						sets *v to it's value (NULL for none) and *l to it's length (or NOLEN),
+ *						false if n doesn't have one
+ */
+
+// process an attribute restriction
+// it's important that we don't save the matches for all regexes until we know all of them
+// match. otherwise if you were trying to match <foo="bar" bar="baz"> and you had a list like
+// <foo="bar" bar="baz">   (both regexes match)
+// <foo="barr" bar="quux"> (the first one matches and overwrites the previous match for foo)
+// then you would be left with foo="barr" bar="baz" as your matches
+int ATTRS_PROCESS( struct trans *tr, NODE node, struct context *ctx )
+{
+	struct attribute *attr;
+	struct cached_regex *c;
+	char *value;
+	size_t len;
+
+	// first pass makes sure each attribute matches
+	for( attr = tr->attrs; attr != NULL; attr = attr->next )
+	{
+		if( !FIND_ATTR( ctx, node, attr, &value, &len ))
+			return 0;
+		// if there's no value it will only match if we didn't specify a regex
+		if( value == NULL )
+		{
+			if( attr->re.re_magic == 0 )
+				continue;
+			return 0;
+		}
+		// otherwise the regex has to match the value, and without one nothing does
+		if( attr->re.re_magic == 0 )
+			return 0;
+		if( !cached_regexec( ctx, &attr->re, attr->key, value, &len )->ok )
+		{
+			ctx->cap[attr->slot].str = NULL;
+			return 0;
+		}
+	}
+	// second pass saves the matches (the cache already has them)
+	for( attr = tr->attrs; attr != NULL; attr = attr->next )
+	{
+		FIND_ATTR( ctx, node, attr, &value, &len );
+		if( value == NULL )
+			continue;
+		c = cached_regexec( ctx, &attr->re, attr->key, value, &len );
+		memcpy( ctx->cap[attr->slot].match, c->match, sizeof( c->match ));
+		ctx->cap[attr->slot].str = value;
+	}
+	return 1;
+}
+
+// starts a machine on a list of siblings: pushes a frame and takes it's current state and next
+// state bitmasks off the context's stack, our inital current state is E(start)
+void PUSH_FRAME( struct context *ctx, struct machine *m, NODE node, NODE end )
+{
+	struct frame *f;
+
+	if( ctx->depth >= ctx->nframes )
+	{
+		ctx->nframes = ctx->nframes ? ctx->nframes * 2 : 16;
+		ctx->frames = realloc( ctx->frames, ctx->nframes * sizeof( *ctx->frames ));
+	}
+	f = &ctx->frames[ctx->depth++];
+	f->m = m;
+	f->node = node;
+	f->end = end;
+	f->n = N( f->cur_state, m->states );
+	f->cur_state = ctx->bits + ctx->top;
+	f->next_state = f->cur_state + f->n;
+	ctx->top += 2 * f->n;
+	memset( f->cur_state, 0, f->n * sizeof( *f->cur_state ));
+	OR( f->cur_state, m->E[m->start->num], m->states );
+	f->st = NULL;
+}
+
+// applies a machine to the siblings from node up to (but not including) end, NULL for all of them
+// returns true iff the machine accepts
+// matches to regexes go in the context's captures, neither the tree nor the machine is written to
+// a transition with a -> runs the nested machine on the node's children in a frame of it's own
+// on the context's stack, so deep expressions don't need a deep C stack
+int TREE_PROCESS( struct machine *m, NODE node, NODE end, struct context *ctx )
+{
+	struct frame *f;
+	struct state *cur;
+	struct trans *tr;
+	NODE n;
+	int *e, base = ctx->depth, nested = 0, ret = 0;
+	unsigned int i;
+	int sum;
+
+	if( m == NULL )
+		return 1;
+	PUSH_FRAME( ctx, m, node, end );
+
+	// main loop, a frame is done when it runs out of input or when there's no states in the
+	// cur_state bitmask
+	for( ;; )
+	{
+		f = &ctx->frames[ctx->depth - 1];
+		m = f->m;
+		n = f->node;
+
+		// a nested machine just finished with the children of n
+		if( nested )
+		{
+			nested = 0;
+			tr = f->st->tr;
+			if( ret && ( tr->re.re_magic == 0
+				|| regex_process( tr, CONTENT( ctx, n ), &f->len, ctx )))
+				OR( f->next_state, m->E[tr->st->num], m->states );
+			f->st = f->st->next;
+		}
+		else if( f->st == NULL )
+		{
+			// starting on a node, unless the frame is done
+			if( f->node != f->end )
+			{
+				// each node we look at counts against the budget
+				if( notbuiltin_regscratch_spend( ctx->scratch, 1 ))
+					ctx->status = TREEXPR_EBUDGET;
+
+				// are we still alive?
+				sum = 0;
+				for( i = 0; i < f->n; i++ )
+					sum |= f->cur_state[i];
+			}
+			if( f->node == f->end || ctx->status != 0 || sum == 0 )
+			{
+				// the machine accepts the input if we end up in the final state
+				ret = ctx->status == 0 && TEST_BIT( f->cur_state, m->final->num );
+				ctx->top -= 2 * f->n;
+				ctx->depth--;
+				if( ctx->depth == base )
+					return ret;
+				nested = 1;
+				continue;
+			}
+
+			// zero out next_state and start adding states we can reach by normal transitions
+			memset( f->next_state, 0, f->n * sizeof( *f->next_state ));
+			f->st = m->start;
+			f->len = CONTENT_LEN( ctx, n );
+		}
+
+		// for each state in the cur_state bitmask we try a transition
+		for( ; f->st != NULL; f->st = f->st->next )
+		{
+			cur = f->st;
+			tr = cur->tr;
+			if( tr == NULL || !TEST_BIT( f->cur_state, cur->num ))
+				continue;
+			// first we must match the name and attributes
+			if( !NAME_OK( ctx, tr, n ))
+				continue;
+			if( tr->attrs != NULL && !ATTRS_PROCESS( tr, n, ctx ))
+				continue;
+			// second we can match a machine (we come back here when it's done) and regexp
+			if( tr->ptr != NULL )
+				break;
+			if( tr->re.re_magic != 0
+				&& !regex_process( tr, CONTENT( ctx, n ), &f->len, ctx ))
+				continue;
+			// we have a winner! add E(st) to the next state bitmap
+			OR( f->next_state, m->E[tr->st->num], m->states );
+		}
+		if( f->st != NULL )
+		{
+			PUSH_FRAME( ctx, f->st->tr->ptr, CHILDREN( ctx, n ), NULL );
+			continue;
+		}
+
+		// advance input
+		f->node = NEXT( ctx, n );
+
+		// swap cur_state and next_state pointers, saves us a copy operation
+		e = f->cur_state;
+		f->cur_state = f->next_state;
+		f->next_state = e;
+	}
+}
+
+// runs a machine on one node by itself (without siblings)
+// captures left over from earlier nodes are forgotten first, so they can't show up in this
+// node's matches
+int NODE_PROCESS( struct machine *m, NODE node, struct context *ctx )
+{
+	int i;
+
+	for( i = 0; i < m->slots; i++ )
+		ctx->cap[i].str = NULL;
+	return TREE_PROCESS( m, node, NEXT( ctx, node ), ctx );
+}
+
+#undef PUSH_FRAME
+#undef TREE_PROCESS
+#undef NODE_PROCESS
+#undef ATTRS_PROCESS
+#undef NODE
+#undef NAME_OK
+#undef CHILDREN
+#undef NEXT
+#undef CONTENT
+#undef CONTENT_LEN
+#undef FIND_ATTR
@@ -143,7 +143,11 @@ For example something like "\1.\2.\3.\4" would produce "192.168.1.42".
 #include <string.h>
 #include <ctype.h>
 #include <libxml/tree.h>
+#include <libxml/parser.h>
+#include <libxml/HTMLparser.h>
+#include <libxml/xmlreader.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "regex.h"
 #include "treexpr.h"
 
@@ -347,6 +351,7 @@ struct machine *closure( struct machine *a )
 }
 
 void free_machine( struct machine *m );
+void free_context( struct context *ctx );
 
 // free each state in a linked list
 void free_states( struct state *sl )
@@ -367,12 +372,14 @@ void free_states( struct state *sl )
 			// free all the junk that can hang off of a transition
 			free_machine( tr->ptr );
 			free( tr->name );
+			free( tr->pat );
 			if( tr->re.re_magic != 0 )
 				notbuiltin_regfree( &tr->re );
 			for( at = tr->attrs; at != NULL; at = atn )
 			{
 				atn = at->next;
 				free( at->name );
+				free( at->pat );
 				if( at->re.re_magic != 0 )
 					notbuiltin_regfree( &at->re );
 				free( at );
@@ -410,11 +417,18 @@ void free_machine( struct machine *m )
 		free( m->E );
 	}
 
-	// free bitmasks
-	if( m->cur_state != NULL )
-		free( m->cur_state );
-	if( m->next_state != NULL )
-		free( m->next_state );
+	free_context( m->ctx );
+	for( i = 0; i < m->npctx; i++ )
+		free_context( m->pctx[i] );
+	free( m->pctx );
+
+	// free literals
+	if( m->lits != NULL )
+	{
+		for( i = 0; m->lits[i] != NULL; i++ )
+			free( m->lits[i] );
+		free( m->lits );
+	}
 
 	// finally free the machine
 	free( m );
@@ -579,7 +593,7 @@ const char *parse_attrs( const char *expr, struct attribute **a )
 			attr->re.re_magic = 0;
 			return NULL;
 		}
-		free( tk.name );
+		attr->pat = tk.name;
 		next = get_tok( next, &tk );
 	}
 	if( tk.t == T_RIGHTANGLE )
@@ -665,8 +679,10 @@ const char *parse_factor( const char *expr, struct machine **m )
 				( *m )->start->tr->re.re_magic = 0;
 				( *m )->error = "Error parsing regular expression";
 				( *m )->buf = cur;
+				free( tk.name );
 			}
-			free( tk.name );
+			else
+				( *m )->start->tr->pat = tk.name;
 			return next;
 		}
 
@@ -830,90 +846,278 @@ const char *parse_treexpr( const char *expr, struct machine **m )
 }
 
 
+/*
+ * Execution contexts
+ *
+ * A context holds what a run over one document needs besides the machine: scratch space for the
+ * regex matcher and a cache of regex results. Identical regexes (after interning) tested against
+ * the same node, from different states or from different ancestors, only run once per document.
+ */
+
+#define CACHE_MIN	( 64 )
+#define CACHE_MAX	( 1 << 16 )
+
+struct context *new_context( void )
+{
+	struct context *ctx = zalloc( sizeof( struct context ));
+
+	while( ctx->scratch == NULL )
+		ctx->scratch = notbuiltin_regscratch_alloc();
+	ctx->gen = 1;
+	return ctx;
+}
+
+void free_context( struct context *ctx )
+{
+	if( ctx == NULL )
+		return;
+	notbuiltin_regscratch_free( ctx->scratch );
+	free( ctx->cache );
+	free( ctx->cap );
+	free( ctx->re );
+	free( ctx->bits );
+	free( ctx->frames );
+	free( ctx->nodes );
+	free( ctx->tag );
+	free( ctx->start );
+	free( ctx );
+}
+
+// forget every cached result
+void forget_results( struct context *ctx )
+{
+	ctx->used = 0;
+	if( ++ctx->gen == 0 )
+	{
+		memset( ctx->cache, 0, ctx->size * sizeof( *ctx->cache ));
+		ctx->gen = 1;
+	}
+}
+
+// gets a context ready for a new document: node addresses mean nothing once the last
+// document is gone, and the new one gets a fresh budget
+void begin_document( struct context *ctx )
+{
+	forget_results( ctx );
+	notbuiltin_regscratch_budget( ctx->scratch, ctx->steps, ctx->msec );
+	ctx->status = 0;
+}
+
+#define CACHE_HASH( re, str )	(((size_t)( re ) >> 4 ) * 31 + ((size_t)( str ) >> 3 ) * 0x9e3779b1 )
+
+// finds the slot for the result of a regex on a string, len is part of the key unless it's NOLEN
+// if the slot's gen isn't the context's, we don't have the result yet and the caller fills it in
+struct cached_regex *cache_slot( struct context *ctx, const regex_t *re, const char *str,
+	size_t len )
+{
+	struct cached_regex *old, *c;
+	unsigned int i, size;
+
+	// keep the table at most half full, or start over once it's as big as we let it get
+	if(( ctx->used + 1 ) * 2 > ctx->size )
+	{
+		if( ctx->size >= CACHE_MAX )
+			forget_results( ctx );
+		else
+		{
+			old = ctx->cache;
+			size = ctx->size;
+			ctx->size = size ? size * 2 : CACHE_MIN;
+			ctx->cache = zalloc( ctx->size * sizeof( *ctx->cache ));
+			ctx->used = 0;
+			for( i = 0; i < size; i++ )
+				if( old[i].gen == ctx->gen )
+				{
+					c = cache_slot( ctx, old[i].re, old[i].str, old[i].len );
+					*c = old[i];
+				}
+			free( old );
+		}
+	}
+
+	for( i = CACHE_HASH( re, str ) & ( ctx->size - 1 ); ; i = ( i + 1 ) & ( ctx->size - 1 ))
+	{
+		c = &ctx->cache[i];
+		if( c->gen != ctx->gen )
+		{
+			// claim the empty slot
+			c->re = re;
+			c->str = str;
+			c->len = len;
+			ctx->used++;
+			return c;
+		}
+		if( c->re == re && c->str == str && c->len == len )
+			return c;
+	}
+}
+
+size_t index_strlen( struct doc_index *idx, const char *str );
+
+// runs a regex on a string unless we already know the answer
+// len is the length of str or NOLEN, returns the cache entry
+struct cached_regex *cached_regexec( struct context *ctx, regex_t *re, const regex_t *key,
+	const char *str, size_t *len )
+{
+	// an adapter's contents can be views that start in the same place, so there the length is
+	// part of the key too
+	struct cached_regex *c = cache_slot( ctx, key, str, ctx->adapter != NULL ? *len : NOLEN );
+
+	int ret;
+
+	if( c->gen != ctx->gen )
+	{
+		if( *len == NOLEN )
+			*len = ctx->index != NULL ? index_strlen( ctx->index, str ) : strlen( str );
+		ret = notbuiltin_regnexec( re, str, *len, RESUBR, c->match, 0, ctx->scratch );
+		if( ret == REG_EBUDGET )
+			ctx->status = TREEXPR_EBUDGET;
+		c->ok = ret == 0;
+		c->gen = ctx->gen;
+	}
+	return c;
+}
+
 // process a regex restriction (basically just executes the regex)
-int regex_process( struct trans *tr, char *content )
+// len is the length of content, or NOLEN if nobody has needed it yet; we work it out at most
+// once per node no matter how many regexes test it
+int regex_process( struct trans *tr, char *content, size_t *len, struct context *ctx )
 {
+	struct cached_regex *c;
+	struct capture *cap = &ctx->cap[tr->slot];
+
 	if( content == NULL )
 		return 0;
-	if( notbuiltin_regexec( &tr->re, content, RESUBR, tr->match, 0 ) == 0 )
+	c = cached_regexec( ctx, &tr->re, tr->key, content, len );
+	if( c->ok )
 	{
-		tr->str = content;
+		memcpy( cap->match, c->match, sizeof( cap->match ));
+		cap->str = content;
 		return 1;
 	}
-	tr->str = NULL;
+	cap->str = NULL;
 	return 0;
 }
 
-// process an attribute restriction
-// it's important that we don't save the matches for all regexes until we know all of them
-// match. otherwise if you were trying to match <foo="bar" bar="baz"> and you had a list like
-// <foo="bar" bar="baz">   (both regexes match)
-// <foo="barr" bar="quux"> (the first one matches and overwrites the previous match for foo)
-// then you would be left with foo="barr" bar="baz" as your matches
-int attrs_process( struct trans *tr, struct _xmlAttr *properties )
+// a regex waiting to be interned
+struct intern
+{
+	const char *pat;
+	regex_t *re;
+	const regex_t **key;
+};
+
+// collects the regexes of a machine (and the machines nested in it)
+void collect_regexes( struct state *s, struct intern **v, int *n, int *size )
 {
 	struct attribute *attr;
-	struct _xmlAttr *cur;
-	regmatch_t match[RESUBR];
+	struct intern *in;
 
-	// first pass makes sure each attribute matches
-	for( attr = tr->attrs; attr != NULL; attr = attr->next )
+	for( ; s != NULL; s = s->next )
 	{
-		for( cur = properties; cur != NULL; cur = cur->next )
+		if( s->tr == NULL )
+			continue;
+		for( attr = s->tr->attrs; ; attr = attr->next )
 		{
-			if( strcasecmp( attr->name, (char *)cur->name ) == 0 )
+			if( *n + 1 >= *size )
 			{
-				// if there's no value it will only match if we didn't specify a regex
-				if( cur->children == NULL )
-				{
-					if( attr->re.re_magic == 0 )
-						break;
-					return 0;
-				}
-				// otherwise the regex has to match the value
-				if( notbuiltin_regexec( &attr->re,
-					(char *)cur->children->content, RESUBR,
-					match, 0 ) == 0 )
-					break;
-				else
-					attr->str = NULL;
-				return 0;
+				*size = *size ? *size * 2 : 16;
+				*v = realloc( *v, *size * sizeof( **v ));
 			}
-		}
-		if( cur == NULL )
-			return 0;
-	}
-	// second pass saves the matches
-	for( attr = tr->attrs; attr != NULL; attr = attr->next )
-	{
-		for( cur = properties; cur != NULL; cur = cur->next )
-		{
-			if( strcasecmp( attr->name, (char *)cur->name ) == 0 )
+			in = &( *v )[*n];
+			if( attr == NULL )
 			{
-				// if there's no value it will only match if we didn't specify a regex
-				if( cur->children == NULL )
-				{
-					if( attr->re.re_magic == 0 )
-						break;
-					return 0;
-				}
-				// otherwise the regex has to match the value
-				if( notbuiltin_regexec( &attr->re,
-					(char *)cur->children->content, RESUBR,
-					attr->match, 0 ) == 0 )
+				// the transition's own regex goes after the attributes
+				if( s->tr->re.re_magic != 0 )
 				{
-					attr->str = (char *)cur->children->content;
-					break;
+					in->pat = s->tr->pat;
+					in->re = &s->tr->re;
+					in->key = &s->tr->key;
+					( *n )++;
 				}
-				else
-					attr->str = NULL;
-				return 0;
+				break;
+			}
+			if( attr->re.re_magic != 0 )
+			{
+				in->pat = attr->pat;
+				in->re = &attr->re;
+				in->key = &attr->key;
+				( *n )++;
 			}
 		}
-		if( cur == NULL )
-			return 0;
+		if( s->tr->ptr != NULL )
+			collect_regexes( s->tr->ptr->start, v, n, size );
 	}
-	return 1;
+}
+
+// sorts regexes by source
+int intern_cmp( const void *a, const void *b )
+{
+	const struct intern *x = a, *y = b;
+
+	return strcmp( x->pat, y->pat );
+}
+
+// gives every regex the key of the first regex with the same source
+void intern_regexes( struct machine **m, int nm )
+{
+	struct intern *v = NULL;
+	int i, j, n = 0, size = 0;
+
+	for( i = 0; i < nm; i++ )
+	{
+		collect_regexes( m[i]->start, &v, &n, &size );
+		m[i]->interned = 1;
+	}
+	qsort( v, n, sizeof( *v ), intern_cmp );
+	for( i = 0; i < n; i = j )
+		for( j = i; j < n && strcmp( v[i].pat, v[j].pat ) == 0; j++ )
+			*v[j].key = v[i].re;
+	free( v );
+}
+
+void prepare_machine( struct machine *m );
+
+// makes sure a context has room to run m
+void fit_context( struct context *ctx, struct machine *m )
+{
+	if( ctx->ncap < m->slots )
+	{
+		free( ctx->cap );
+		ctx->ncap = m->slots;
+		ctx->cap = zalloc( ctx->ncap * sizeof( *ctx->cap ));
+	}
+	if( ctx->nre < m->slots * ( RESUBR - 1 ) + 1 )
+	{
+		free( ctx->re );
+		ctx->nre = m->slots * ( RESUBR - 1 ) + 1;
+		ctx->re = zalloc( ctx->nre * sizeof( *ctx->re ));
+	}
+	if( ctx->nbits < m->words )
+	{
+		free( ctx->bits );
+		ctx->nbits = m->words;
+		ctx->bits = zalloc( ctx->nbits * sizeof( *ctx->bits ));
+	}
+	if( ctx->ntag < m->syms )
+	{
+		free( ctx->tag );
+		ctx->ntag = m->syms;
+		ctx->tag = zalloc( ctx->ntag * sizeof( *ctx->tag ));
+	}
+}
+
+// gets a machine ready to run over a new document with it's own context
+struct context *machine_context( struct machine *m )
+{
+	if( !m->interned )
+		intern_regexes( &m, 1 );
+	prepare_machine( m );
+	if( m->ctx == NULL )
+		m->ctx = new_context();
+	fit_context( m->ctx, m );
+	begin_document( m->ctx );
+	return m->ctx;
 }
 
 // some handy macros:
@@ -932,217 +1136,352 @@ int attrs_process( struct trans *tr, struct _xmlAttr *properties )
 // compute the disjunction of two bitfields of n bits
 #define OR( x, y, n )		{unsigned int _i;for(_i=0;_i<N(x,n);(x)[_i]|=(y)[_i],_i++);}
 
-// applies a machine to an xml tree
-// returns true iff the machine accepts
-// all matches to regexes are contained within the machine
-int tree_process( struct machine *m, xmlNodePtr node )
+// Generate E function
+// the E function is an array of bitmasks indexed by state number
+// the bitmask represents the states you can reach by epsilon transitions
+void build_e( struct machine *m )
 {
 	int *e, done;
 	struct state *cur, *cur2;
-	struct trans *tr;
 	struct epsilon *ep;
 
-	if( m == NULL )
-		return 1;
-	if( m->E == NULL )
+	// number states
+	m->states = 0;
+	for( cur = m->start; cur != NULL; cur = cur->next )
+		cur->num = m->states++;
+
+	// fill E
+	m->E = zalloc( sizeof( *m->E ) * m->states );
+	for( cur = m->start; cur != NULL; cur = cur->next )
 	{
-		// Generate E function
-		// the E function is an array of bitmasks indexed by state number
-		// the bitmask represents the states you can reach by epsilon transitions
+		e = m->E[cur->num] = zalloc( N( *m->E, m->states ) * sizeof( **m->E ));
 
-		// number states
-		m->states = 0;
-		for( cur = m->start; cur != NULL; cur = cur->next )
-			cur->num = m->states++;
+		// we can reach ourself
+		SET_BIT( e, cur->num );
 
-		// fill E
-		m->E = zalloc( sizeof( *m->E ) * m->states );
-		for( cur = m->start; cur != NULL; cur = cur->next )
+		// try to add new states until an iteration of this loop makes no progress
+		done = 0;
+		while( !done )
 		{
-			e = m->E[cur->num] = zalloc( N( *m->E, m->states ) * sizeof( **m->E ));
+			done = 1;
+			// for each state that is already in the bitmask, add states you can reach
+			// by epsilon transitions
+			for( cur2 = m->start; cur2 != NULL; cur2 = cur2->next )
+				if( TEST_BIT( e, cur2->num ))
+					for( ep = cur2->ep; ep != NULL; ep = ep->next )
+						if( !TEST_BIT( e, ep->st->num ))
+						{
+							SET_BIT( e, ep->st->num );
+							done = 0;
+						}
+		}
+	}
+}
 
-			// we can reach ourself
-			SET_BIT( e, cur->num );
+// builds E for a machine and the machines nested in it, gives each regex a slot numbered
+// in the order find_matches reports them, and numbers the names of transitions and attributes
+// returns the ints of state bitmask a run of m needs
+int prepare_states( struct machine *top, struct machine *m )
+{
+	struct state *s;
+	struct attribute *attr;
+	int w, words = 0;
 
-			// try to add new states until an iteration of this loop makes no progress
-			done = 0;
-			while( !done )
-			{
-				done = 1;
-				// for each state that is already in the bitmask, add states you can reach
-				// by epsilon transitions
-				for( cur2 = m->start; cur2 != NULL; cur2 = cur2->next )
-					if( TEST_BIT( e, cur2->num ))
-						for( ep = cur2->ep; ep != NULL; ep = ep->next )
-							if( !TEST_BIT( e, ep->st->num ))
-							{
-								SET_BIT( e, ep->st->num );
-								done = 0;
-							}
-			}
+	if( m->E == NULL )
+		build_e( m );
+	for( s = m->start; s != NULL; s = s->next )
+	{
+		if( s->tr == NULL )
+			continue;
+		s->tr->sym = top->syms++;
+		for( attr = s->tr->attrs; attr != NULL; attr = attr->next )
+		{
+			attr->sym = top->syms++;
+			if( attr->re.re_magic != 0 )
+				attr->slot = top->slots++;
+		}
+		if( s->tr->re.re_magic != 0 )
+			s->tr->slot = top->slots++;
+		if( s->tr->ptr != NULL )
+		{
+			w = prepare_states( top, s->tr->ptr );
+			if( w > words )
+				words = w;
 		}
 	}
+	return words + 2 * N( *m->E, m->states );
+}
 
-	// allocate current state and next state bitmasks
-	if( m->cur_state == NULL )
-		m->cur_state = zalloc( N( m->cur_state, m->states ) * sizeof( *m->cur_state ));
-	if( m->next_state == NULL )
-		m->next_state = zalloc( N( m->next_state, m->states ) * sizeof( *m->next_state ));
-
-	// our inital current state is E(start)
-	memset( m->cur_state, 0, N( m->cur_state, m->states ) * sizeof( *m->cur_state ));
-	OR( m->cur_state, m->E[m->start->num], m->states );
+// works out everything a run needs from the machine up front, so runs only read it
+void prepare_machine( struct machine *m )
+{
+	if( m->ready )
+		return;
+	m->slots = 0;
+	m->syms = 0;
+	m->words = prepare_states( m, m );
+	m->ready = 1;
+}
 
-	// main loop, terminate when we run out of input or when there's no states in the cur_state bitmask
-	while( node != NULL )
-	{
-		unsigned int i;
-		int sum = 0;
+// finds the attribute of a libxml node with the same name as attr
+int xml_find_attr( xmlNodePtr node, struct attribute *attr, char **value, size_t *len )
+{
+	struct _xmlAttr *cur;
 
-		// are we still alive?
-		for( i = 0; i < N( m->cur_state, m->states ); i++ )
-			sum |= m->cur_state[i];
-		if( sum == 0 ) break;
+	for( cur = node->properties; cur != NULL; cur = cur->next )
+		if( strcasecmp( attr->name, (char *)cur->name ) == 0 )
+		{
+			*value = cur->children != NULL ? (char *)cur->children->content : NULL;
+			*len = NOLEN;
+			return 1;
+		}
+	return 0;
+}
 
-		// zero out next_state and start adding states we can reach by normal transitions
-		memset( m->next_state, 0, N( m->next_state, m->states ) * sizeof( *m->next_state ));
+// the matcher for libxml trees
+#define PUSH_FRAME			push_frame
+#define TREE_PROCESS		tree_process
+#define NODE_PROCESS		node_process
+#define ATTRS_PROCESS		attrs_process
+#define NODE				xmlNodePtr
+#define NAME_OK( ctx, tr, n )	( strcmp(( tr )->name, "." ) == 0 || (( n )->name != NULL \
+	&& strcasecmp(( tr )->name, (char *)( n )->name ) == 0 ))
+#define CHILDREN( ctx, n )	(( n )->children )
+#define NEXT( ctx, n )		(( n )->next )
+#define CONTENT( ctx, n )	((char *)( n )->content )
+#define CONTENT_LEN( ctx, n )	NOLEN
+#define FIND_ATTR( ctx, n, attr, v, l )	xml_find_attr( n, attr, v, l )
+
+#include "treewalk.c"
+
+// extracts regex matches from the context after a machine has been run on a node
+// fills ctx->re in the order the regexes appear in the expression and links them together,
+// returns the number of matches in the array
+int find_matches( struct machine *m, struct context *ctx )
+{
+	struct regex_match *re = ctx->re;
+	struct capture *cap;
+	int i, j, n = 0;
 
-		// for each state in the cur_state bitmask we try a transition
-		for( cur = m->start; cur != NULL; cur = cur->next )
-			if( TEST_BIT( m->cur_state, cur->num ))
+	// slots are numbered in expression order: <foo>, then : "foo", then the ->
+	for( i = 0; i < m->slots; i++ )
+	{
+		cap = &ctx->cap[i];
+		if( cap->str == NULL )
+			continue;
+		for( j = 1; j < RESUBR; j++ )
+			if( cap->match[j].rm_eo != -1 )
 			{
-				tr = cur->tr;
-				if( tr != NULL )
-				{
-					// first we must match the name and attributes
-					if( strcmp( tr->name, "." ) != 0 &&
-						( node->name == NULL || strcasecmp( tr->name, (char *)node->name ) != 0 ))
-						continue;
-					if( tr->attrs != NULL && !attrs_process( tr, node->properties ))
-						continue;
-					// second we can match a machine and regexp
-					if( tr->ptr != NULL && !tree_process( tr->ptr, node->children ))
-						continue;
-					if( tr->re.re_magic != 0 && !regex_process( tr, (char *)node->content ))
-						continue;
-					// we have a winner! add E(st) to the next state bitmap
-					OR( m->next_state, m->E[tr->st->num], m->states );
-				}
+				re[n].match = cap->match[j];
+				re[n].str = cap->str;
+				n++;
 			}
-		// advance input
-		node = node->next;
-
-		// swap cur_state and next_state pointers, saves us a copy operation
-		e = m->cur_state;
-		m->cur_state = m->next_state;
-		m->next_state = e;
 	}
 
-	// the machine accepts the input if we end up in the final state
-	done = TEST_BIT( m->cur_state, m->final->num );
-	return done;
+	// maintain linked list
+	for( i = 0; i < n; i++ )
+		re[i].next = i + 1 < n ? &re[i + 1] : NULL;
+	return n;
 }
 
-// extracts regex matches from a machine after it has been run
-struct regex_match *find_matches( struct state *s, struct regex_match *m )
+// saves the node to carry on with once we're done with the children of it's previous sibling
+void push_node( struct context *ctx, void *node )
 {
-	struct regex_match *cur, *head;
-	struct trans *tr;
-	struct attribute *attr;
-	int i;
-
-	if( s == NULL )
-		return m;
+	if( ctx->sp >= ctx->nnodes )
+	{
+		ctx->nnodes = ctx->nnodes ? ctx->nnodes * 2 : 64;
+		ctx->nodes = realloc( ctx->nodes, ctx->nnodes * sizeof( *ctx->nodes ));
+	}
+	ctx->nodes[ctx->sp++] = node;
+}
 
-	// recurse to next state first, so we can add the matches in the current state to the
-	// front of the list
-	m = find_matches( s->next, m );
+// runs machine m on each xml node at this level from node up to (but not including) end, then
+// recurses to it's children, calling cb for each match in document order
+// returns TREEXPR_STOP if the callback asked us to stop, or on the first match if cb is NULL
+int node_recurse( struct machine *m, xmlNodePtr node, xmlNodePtr end, match_callback cb,
+	void *user, struct context *ctx )
+{
+	xmlNodePtr cur = node;
+	int n, ret, base = ctx->sp;
 
-	// grab matches in this state
-	tr = s->tr;
-	if( tr != NULL )
+	for( ;; )
 	{
-		// the -> comes after <foo> in the expression, so search it first
-		if( tr->ptr != NULL )
-			m = find_matches( tr->ptr->start, m );
-
-		// next search : "foo"
-		if( tr->str != NULL )
+		// at the end of a list of children go back to the parent's next sibling
+		if( cur == ( ctx->sp == base ? end : NULL ))
 		{
-			// loop backwards so that list builds forwards
-			for( i = RESUBR - 1; i > 0; i-- )
-				if( tr->match[i].rm_eo != -1 )
-				{
-					cur = zalloc( sizeof( struct regex_match ));
-					cur->match = tr->match[i];
-					cur->str = tr->str;
-					cur->next = m;
-					m = cur;
-				}
+			if( ctx->sp == base )
+				return TREEXPR_CONTINUE;
+			cur = ctx->nodes[--ctx->sp];
+			continue;
 		}
-
-		// last search <foo>
-		// loop forwards because we have no choice, but build list backwards
-		head = NULL;
-		cur = NULL;
-		for( attr = tr->attrs; attr != NULL; attr = attr->next )
+		ret = node_process( m, cur, ctx );
+		if( ctx->status != 0 )
+			break;
+		if( ret )
 		{
-			if( attr->str == NULL )
+			// without a callback we only want to know if there's a match
+			if( cb == NULL )
+				break;
+			n = find_matches( m, ctx );
+			ret = cb( cur, n > 0 ? ctx->re : NULL, n, user );
+			if( ret == TREEXPR_STOP )
+				break;
+			if( ret == TREEXPR_SKIP )
+			{
+				cur = cur->next;
 				continue;
-			for( i = 1; i < RESUBR; i++ )
-				if( attr->match[i].rm_eo != -1 )
-				{
-					if( head == NULL )
-						cur = head = zalloc( sizeof( struct regex_match ));
-					else
-						cur = cur->next = zalloc( sizeof( struct regex_match ));
-					cur->match = attr->match[i];
-					cur->str = attr->str;
-					cur->next = NULL;
-				}
-		}
-		if( head != NULL )
-		{
-			cur->next = m;
-			m = head;
+			}
 		}
+		// go down to the children
+		push_node( ctx, cur->next );
+		cur = cur->children;
 	}
-	return m;
+	ctx->sp = base;
+	return TREEXPR_STOP;
 }
 
-// runs machine m on each xml node at this level, then recurses to it's children, building a
-// list of matches
-struct match *node_recurse( struct machine *m, xmlNodePtr node, struct match *n )
+// state passed to the callback below
+struct count_callback
 {
-	xmlNodePtr cur, next;
-	struct match *xml;
+	match_callback cb;
+	void *user;
+	int n;
+};
+
+// counts matches on their way to the user's callback
+int count_callback( xmlNodePtr node, struct regex_match *re, int nre, void *user )
+{
+	struct count_callback *cc = user;
+
+	cc->n++;
+	return cc->cb( node, re, nre, cc->user );
+}
+
+// run a machine on each node in an xml document and call cb for each match in document order
+// returns the number of matches
+int document_process_cb( struct machine *m, xmlDocPtr doc, match_callback cb, void *user )
+{
+	struct count_callback cc;
+	struct context *ctx;
+
+	cc.cb = cb;
+	cc.user = user;
+	cc.n = 0;
+	ctx = machine_context( m );
+	node_recurse( m, doc->children->next, NULL, count_callback, &cc, ctx );
+	return ctx->status != 0 ? ctx->status : cc.n;
+}
+
+// copies a match into a list (in reverse document order)
+int list_callback( xmlNodePtr node, struct regex_match *re, int nre, void *user )
+{
+	struct match **n = user, *xml;
+	struct regex_match *cur;
+	int i;
+
+	xml = zalloc( sizeof( struct match ));
+	xml->next = *n;
+	xml->node = node;
 
-	if( node == NULL )
-		return n;
-	for( cur = node; cur != NULL; cur = cur->next )
+	// loop backwards so that list builds forwards
+	for( i = nre - 1; i >= 0; i-- )
 	{
-		// this will consider each node by itself (without siblings)
-		next = cur->next;
-		cur->next = NULL;
-		if( tree_process( m, cur ))
-		{
-			xml = zalloc( sizeof( struct match ));
-			xml->next = n;
-			xml->node = cur;
-			xml->re = find_matches( m->start, NULL );
-			n = xml;
-		}
-		cur->next = next;
-		// recurse to children
-		n = node_recurse( m, cur->children, n );
+		cur = zalloc( sizeof( struct regex_match ));
+		cur->match = re[i].match;
+		cur->str = re[i].str;
+		cur->next = xml->re;
+		xml->re = cur;
 	}
-	return n;
+	*n = xml;
+	return TREEXPR_CONTINUE;
 }
 
 // run a machine on each node in an xml document and return a list of matches
 struct match *document_process( struct machine *m, xmlDocPtr doc )
 {
-	return node_recurse( m, doc->children->next, NULL );
+	struct match *n = NULL;
+
+	document_process_cb( m, doc, list_callback, &n );
+	return n;
+}
+
+// state passed to the callback below
+struct limit_callback
+{
+	struct match *head, *tail;
+	int n, max;
+};
+
+// appends a match to a list (in document order) and stops when the list is long enough
+int limit_callback( xmlNodePtr node, struct regex_match *re, int nre, void *user )
+{
+	struct limit_callback *lc = user;
+	struct match *xml;
+	struct regex_match *cur = NULL;
+	int i;
+
+	xml = zalloc( sizeof( struct match ));
+	xml->node = node;
+	for( i = 0; i < nre; i++ )
+	{
+		if( cur == NULL )
+			cur = xml->re = zalloc( sizeof( struct regex_match ));
+		else
+			cur = cur->next = zalloc( sizeof( struct regex_match ));
+		cur->match = re[i].match;
+		cur->str = re[i].str;
+	}
+
+	// maintain linked list
+	if( lc->tail == NULL )
+		lc->head = xml;
+	else
+		lc->tail->next = xml;
+	lc->tail = xml;
+
+	if( ++lc->n == lc->max )
+		return TREEXPR_STOP;
+	return TREEXPR_CONTINUE;
+}
+
+// run a machine on an xml document and return a list of the first max matches in document
+// order, the search stops as soon as we have them (max <= 0 means no limit)
+struct match *document_process_n( struct machine *m, xmlDocPtr doc, int max )
+{
+	struct limit_callback lc;
+
+	lc.head = lc.tail = NULL;
+	lc.n = 0;
+	lc.max = max;
+	document_process_cb( m, doc, limit_callback, &lc );
+	return lc.head;
+}
+
+// returns true iff the machine matches anywhere in an xml document
+// this stops at the first match and doesn't allocate any matches
+int document_match( struct machine *m, xmlDocPtr doc )
+{
+	struct context *ctx = machine_context( m );
+	int ret;
+
+	ret = node_recurse( m, doc->children->next, NULL, NULL, NULL, ctx ) == TREEXPR_STOP;
+	return ctx->status != 0 ? ctx->status : ret;
+}
+
+// limits how much work each run of m may do on a document: steps counts nodes visited
+// and the slow parts of regex matching, msec is wall clock time; 0 means no limit
+void machine_budget( struct machine *m, long steps, long msec )
+{
+	if( m->ctx == NULL )
+		m->ctx = new_context();
+	m->ctx->steps = steps;
+	m->ctx->msec = msec;
+}
+
+// returns TREEXPR_EBUDGET if the last run of m went over budget, 0 otherwise
+int document_status( struct machine *m )
+{
+	return m->ctx != NULL ? m->ctx->status : 0;
 }
 
 // free matches returned by document_process
@@ -1162,3 +1501,3074 @@ void free_matches( struct match *z )
 		free( z );
 	}
 }
+
+/*
+ * Parallel runs
+ *
+ * Work is split into tasks numbered in the order their results go together. Each thread has it's
+ * own context and a range of tasks. It works through it's range from the front, and once that's
+ * empty it steals from the back of the other threads' ranges, so a thread mostly works on tasks
+ * that are next to each other.
+ *
+ * A big document is cut up into subtrees small enough to share out evenly, and the nodes above them
+ * on their own. Each task keeps it's matches in document order, so putting the tasks' lists
+ * together in task order gives us the matches in document order. A batch of machines and
+ * documents is cut up into (machine, document) pairs, grouped by document.
+ */
+
+#define TASKS_PER_THREAD	( 16 )
+
+// a piece of a document
+struct task
+{
+	xmlNodePtr node;
+	int whole; // the node and everything below it, or just the node
+	struct limit_callback lc; // matches, in document order
+};
+
+// a thread and the tasks it has left, lo .. hi - 1
+struct worker
+{
+	pthread_t thread;
+	int started; // is thread running
+	pthread_mutex_t lock; // protects lo and hi
+	int lo, hi;
+	struct context *ctx;
+	struct parallel *par;
+};
+
+struct parallel
+{
+	void (*run)( struct worker *w, int k ); // does task k
+	int ntasks;
+	struct worker *w;
+	int nw;
+	pthread_mutex_t lock; // protects stop
+	int stop; // no more tasks should be started
+	// document_process_parallel
+	struct machine *m;
+	struct task *task;
+	int size;
+	int grain; // subtrees with more nodes than this get cut up
+	// treexpr_batch_run
+	struct machine **bm;
+	int nm;
+	xmlDocPtr *doc;
+	struct match **results;
+	int status; // TREEXPR_EBUDGET if any run went over budget, protected by lock
+};
+
+// counts the nodes in node's subtree and the subtrees of the siblings after it
+int count_nodes( struct context *ctx, xmlNodePtr node )
+{
+	xmlNodePtr cur = node;
+	int n = 0, base = ctx->sp;
+
+	for( ;; )
+	{
+		// at the end of a list of children go back to the parent's next sibling
+		if( cur == NULL )
+		{
+			if( ctx->sp == base )
+				return n;
+			cur = ctx->nodes[--ctx->sp];
+			continue;
+		}
+		n++;
+		push_node( ctx, cur->next );
+		cur = cur->children;
+	}
+}
+
+void add_task( struct parallel *par, xmlNodePtr node, int whole )
+{
+	struct task *t;
+
+	if( par->ntasks >= par->size )
+	{
+		par->size = par->size ? par->size * 2 : 64;
+		par->task = realloc( par->task, par->size * sizeof( *par->task ));
+	}
+	t = &par->task[par->ntasks++];
+	memset( t, 0, sizeof( *t ));
+	t->node = node;
+	t->whole = whole;
+}
+
+// adds tasks for node, the siblings after it and everything below them in document order,
+// cutting up subtrees bigger than the grain
+void plan_tasks( struct parallel *par, struct context *ctx, xmlNodePtr node )
+{
+	xmlNodePtr cur = node, up;
+	int *first = NULL, *seen = NULL, nstack = 0, n = 0, base = ctx->sp, d;
+
+	// the context's stack has the nodes we're below, first[d] is the task we added for the d-th
+	// one and seen[d] is how many nodes we'd seen before it
+	for( ;; )
+	{
+		if( cur == NULL )
+		{
+			if( ctx->sp == base )
+				break;
+			// done with everything below up
+			up = ctx->nodes[--ctx->sp];
+			d = ctx->sp - base;
+			// small enough to be one task after all
+			if( n - seen[d] <= par->grain )
+			{
+				par->ntasks = first[d];
+				add_task( par, up, 1 );
+			}
+			cur = up->next;
+			continue;
+		}
+		d = ctx->sp - base;
+		if( d >= nstack )
+		{
+			nstack = nstack ? nstack * 2 : 64;
+			first = realloc( first, nstack * sizeof( *first ));
+			seen = realloc( seen, nstack * sizeof( *seen ));
+		}
+		first[d] = par->ntasks;
+		seen[d] = n++;
+		add_task( par, cur, 0 );
+		push_node( ctx, cur );
+		cur = cur->children;
+	}
+	free( first );
+	free( seen );
+}
+
+// stops anybody starting another task
+void stop_tasks( struct parallel *par )
+{
+	pthread_mutex_lock( &par->lock );
+	par->stop = 1;
+	pthread_mutex_unlock( &par->lock );
+}
+
+// takes the next task from the front of our own range, or from the back of somebody else's
+// returns -1 when there's nothing left to do
+int take_task( struct worker *w )
+{
+	struct parallel *par = w->par;
+	struct worker *v;
+	int i, k = -1;
+
+	pthread_mutex_lock( &par->lock );
+	i = par->stop;
+	pthread_mutex_unlock( &par->lock );
+	if( i )
+		return -1;
+	for( i = 0; i < par->nw && k < 0; i++ )
+	{
+		v = &par->w[( w - par->w + i ) % par->nw];
+		pthread_mutex_lock( &v->lock );
+		if( v->lo < v->hi )
+			k = v == w ? v->lo++ : --v->hi;
+		pthread_mutex_unlock( &v->lock );
+	}
+	return k;
+}
+
+// thread main loop
+void *work( void *arg )
+{
+	struct worker *w = arg;
+	int k;
+
+	while(( k = take_task( w )) >= 0 )
+		w->par->run( w, k );
+	return NULL;
+}
+
+// runs par->ntasks tasks on nthreads threads (counting the one that calls us), thread i uses
+// context ctx[i]
+void run_tasks( struct parallel *par, struct context **ctx, int nthreads )
+{
+	struct worker *w;
+	int i;
+
+	// give each thread an even share of the tasks to start with
+	pthread_mutex_init( &par->lock, NULL );
+	par->nw = nthreads;
+	par->w = zalloc( nthreads * sizeof( *par->w ));
+	for( i = 0; i < nthreads; i++ )
+	{
+		w = &par->w[i];
+		w->par = par;
+		w->ctx = ctx[i];
+		w->lo = (long)par->ntasks * i / nthreads;
+		w->hi = (long)par->ntasks * ( i + 1 ) / nthreads;
+		pthread_mutex_init( &w->lock, NULL );
+	}
+
+	// we're worker 0, if a thread won't start the others steal it's tasks
+	for( i = 1; i < nthreads; i++ )
+		par->w[i].started = pthread_create( &par->w[i].thread, NULL, work, &par->w[i] ) == 0;
+	work( &par->w[0] );
+	for( i = 1; i < nthreads; i++ )
+		if( par->w[i].started )
+			pthread_join( par->w[i].thread, NULL );
+	for( i = 0; i < nthreads; i++ )
+		pthread_mutex_destroy( &par->w[i].lock );
+	pthread_mutex_destroy( &par->lock );
+	free( par->w );
+	par->w = NULL;
+}
+
+// runs a piece of a document, everybody stops once one thread goes over budget
+void run_subtree( struct worker *w, int k )
+{
+	struct parallel *par = w->par;
+	struct task *t = &par->task[k];
+	int n;
+
+	if( t->whole )
+		node_recurse( par->m, t->node, t->node->next, limit_callback, &t->lc, w->ctx );
+	else if( node_process( par->m, t->node, w->ctx ))
+	{
+		n = find_matches( par->m, w->ctx );
+		limit_callback( t->node, n > 0 ? w->ctx->re : NULL, n, &t->lc );
+	}
+	if( w->ctx->status != 0 )
+		stop_tasks( par );
+}
+
+// like document_process, but shares the work out between nthreads threads (counting the one
+// that calls us), the machine mustn't be used for anything else until we return
+// each thread gets the machine's budget, see machine_budget()
+struct match *document_process_parallel( struct machine *m, xmlDocPtr doc, int nthreads )
+{
+	struct parallel par;
+	struct context *ctx;
+	struct match *z = NULL, *xml, *next;
+	int i;
+
+	if( nthreads <= 1 )
+		return document_process( m, doc );
+	ctx = machine_context( m );
+
+	// cut the document up
+	memset( &par, 0, sizeof( par ));
+	par.run = run_subtree;
+	par.m = m;
+	par.grain = count_nodes( ctx, doc->children->next ) / ( nthreads * TASKS_PER_THREAD );
+	plan_tasks( &par, ctx, doc->children->next );
+
+	// the threads' contexts stay with the machine for next time
+	if( m->npctx < nthreads )
+	{
+		m->pctx = realloc( m->pctx, nthreads * sizeof( *m->pctx ));
+		for( ; m->npctx < nthreads; m->npctx++ )
+			m->pctx[m->npctx] = new_context( );
+	}
+	for( i = 0; i < nthreads; i++ )
+	{
+		m->pctx[i]->steps = ctx->steps;
+		m->pctx[i]->msec = ctx->msec;
+		fit_context( m->pctx[i], m );
+		begin_document( m->pctx[i] );
+	}
+
+	run_tasks( &par, m->pctx, nthreads );
+	for( i = 0; i < nthreads; i++ )
+		if( m->pctx[i]->status != 0 )
+			ctx->status = m->pctx[i]->status;
+
+	// put the lists together in reverse document order, like document_process
+	for( i = 0; i < par.ntasks; i++ )
+		for( xml = par.task[i].lc.head; xml != NULL; xml = next )
+		{
+			next = xml->next;
+			xml->next = z;
+			z = xml;
+		}
+	free( par.task );
+	return z;
+}
+
+// runs one machine on one document of a batch, each run gets the machine's own budget
+void run_pair( struct worker *w, int k )
+{
+	struct parallel *par = w->par;
+	struct machine *m = par->bm[k % par->nm];
+	struct context *ctx = w->ctx;
+	struct limit_callback lc;
+	struct match *xml, *next;
+
+	ctx->steps = m->ctx != NULL ? m->ctx->steps : 0;
+	ctx->msec = m->ctx != NULL ? m->ctx->msec : 0;
+	begin_document( ctx );
+	memset( &lc, 0, sizeof( lc ));
+	node_recurse( m, par->doc[k / par->nm]->children->next, NULL, limit_callback, &lc, ctx );
+
+	// reverse document order, like document_process
+	par->results[k] = NULL;
+	for( xml = lc.head; xml != NULL; xml = next )
+	{
+		next = xml->next;
+		xml->next = par->results[k];
+		par->results[k] = xml;
+	}
+	if( ctx->status != 0 )
+	{
+		pthread_mutex_lock( &par->lock );
+		par->status = ctx->status;
+		pthread_mutex_unlock( &par->lock );
+	}
+}
+
+// runs each of nm machines on each of nd documents on nthreads threads (counting the one that
+// calls us), results[d * nm + i] gets the list document_process( m[i], doc[d] ) would return
+// the pairs are handed out grouped by document, so each thread sticks to as few documents as it
+// can, and none of the machines may be used for anything else until we return
+// returns TREEXPR_EBUDGET if any run went over it's machine's budget, 0 otherwise
+int treexpr_batch_run( struct machine **m, int nm, xmlDocPtr *doc, int nd,
+	struct match **results, int nthreads )
+{
+	struct parallel par;
+	struct context **ctx;
+	int i, j;
+
+	memset( &par, 0, sizeof( par ));
+	par.run = run_pair;
+	par.ntasks = nm * nd;
+	par.bm = m;
+	par.nm = nm;
+	par.doc = doc;
+	par.results = results;
+	if( par.ntasks <= 0 )
+		return 0;
+	if( nthreads > par.ntasks )
+		nthreads = par.ntasks;
+	if( nthreads < 1 )
+		nthreads = 1;
+
+	// the machines are only read once we start
+	for( i = 0; i < nm; i++ )
+	{
+		if( !m[i]->interned )
+			intern_regexes( &m[i], 1 );
+		prepare_machine( m[i] );
+	}
+	ctx = zalloc( nthreads * sizeof( *ctx ));
+	for( i = 0; i < nthreads; i++ )
+	{
+		ctx[i] = new_context( );
+		for( j = 0; j < nm; j++ )
+			fit_context( ctx[i], m[j] );
+	}
+
+	run_tasks( &par, ctx, nthreads );
+
+	for( i = 0; i < nthreads; i++ )
+		free_context( ctx[i] );
+	free( ctx );
+	return par.status;
+}
+
+/*
+ * Records
+ *
+ * A big XML file that's just a long list of records doesn't need to be in memory all at once.
+ * The thread that calls us reads the file with an xmlTextReader, expands each record, copies it
+ * into a little document of it's own and puts that on a queue. Worker threads take records off the
+ * queue, run the machine over them and throw them away. The queue only holds a few records per
+ * worker, so the reader waits for the workers rather than reading ahead.
+ */
+
+#define RECORDS_PER_THREAD	( 4 )
+
+struct records
+{
+	struct machine *m;
+	match_callback cb;
+	void *user;
+	pthread_mutex_t lock; // protects everything down to status
+	pthread_cond_t more; // there's a record in the queue, or the reader is done
+	pthread_cond_t room; // there's room in the queue, or we're stopping
+	xmlDocPtr *queue; // records waiting, size of them from head on (wrapping around)
+	int size, head, n;
+	int done; // the reader won't add any more records
+	int stop; // the callback asked us to stop
+	int status; // TREEXPR_EBUDGET if any record went over budget
+	pthread_mutex_t cblock; // one callback at a time, protects count
+	int count; // matches so far
+};
+
+// a worker thread
+struct record_worker
+{
+	pthread_t thread;
+	int started; // is thread running
+	struct context *ctx;
+	struct records *rec;
+};
+
+// passes a match on to the user's callback, one thread at a time
+int record_callback( xmlNodePtr node, struct regex_match *re, int nre, void *user )
+{
+	struct records *rec = user;
+	int ret = TREEXPR_STOP, stop;
+
+	pthread_mutex_lock( &rec->cblock );
+	pthread_mutex_lock( &rec->lock );
+	stop = rec->stop;
+	pthread_mutex_unlock( &rec->lock );
+	if( !stop )
+	{
+		rec->count++;
+		ret = rec->cb( node, re, nre, rec->user );
+		if( ret == TREEXPR_STOP )
+		{
+			pthread_mutex_lock( &rec->lock );
+			rec->stop = 1;
+			pthread_cond_broadcast( &rec->room );
+			pthread_mutex_unlock( &rec->lock );
+		}
+	}
+	pthread_mutex_unlock( &rec->cblock );
+	return ret;
+}
+
+// runs the machine over one record and frees it, each record gets the machine's own budget
+void run_record( struct records *rec, struct context *ctx, xmlDocPtr doc )
+{
+	begin_document( ctx );
+	node_recurse( rec->m, doc->children, NULL, record_callback, rec, ctx );
+	if( ctx->status != 0 )
+	{
+		pthread_mutex_lock( &rec->lock );
+		rec->status = ctx->status;
+		pthread_mutex_unlock( &rec->lock );
+	}
+	xmlFreeDoc( doc );
+}
+
+// worker main loop, runs records until the reader's done and the queue's empty
+void *record_work( void *arg )
+{
+	struct record_worker *w = arg;
+	struct records *rec = w->rec;
+	xmlDocPtr doc;
+	int stop;
+
+	for( ;; )
+	{
+		pthread_mutex_lock( &rec->lock );
+		while( rec->n == 0 && !rec->done )
+			pthread_cond_wait( &rec->more, &rec->lock );
+		if( rec->n == 0 )
+		{
+			pthread_mutex_unlock( &rec->lock );
+			return NULL;
+		}
+		doc = rec->queue[rec->head];
+		rec->head = ( rec->head + 1 ) % rec->size;
+		rec->n--;
+		stop = rec->stop;
+		pthread_cond_signal( &rec->room );
+		pthread_mutex_unlock( &rec->lock );
+
+		// once we've stopped the rest just get thrown away
+		if( stop )
+			xmlFreeDoc( doc );
+		else
+			run_record( rec, w->ctx, doc );
+	}
+}
+
+// puts a record on the queue, waiting for room
+// returns 0 if we've stopped, and the record's been thrown away
+int add_record( struct records *rec, xmlDocPtr doc )
+{
+	int stop;
+
+	pthread_mutex_lock( &rec->lock );
+	while( rec->n == rec->size && !rec->stop )
+		pthread_cond_wait( &rec->room, &rec->lock );
+	stop = rec->stop;
+	if( !stop )
+	{
+		rec->queue[( rec->head + rec->n++ ) % rec->size] = doc;
+		pthread_cond_signal( &rec->more );
+	}
+	pthread_mutex_unlock( &rec->lock );
+	if( stop )
+		xmlFreeDoc( doc );
+	return !stop;
+}
+
+// runs a machine over each element called record in an XML file, one record at a time, on nthreads
+// threads (not counting the one that calls us, which reads the file)
+// options are libxml2 parser options, like the ones for xmlReadFile()
+// cb is called for each match, from any of the threads but only one at a time, records come in no
+// particular order but each record's matches are in document order, and the node (and the record
+// document it's in, node->doc) is only good until the callback returns
+// each record gets the machine's budget, and none of it is used for anything else until we return
+// returns the number of matches, TREEXPR_EREAD if the file couldn't be read, or TREEXPR_EBUDGET
+// if any record went over budget
+int treexpr_records( struct machine *m, const char *filename, const char *record, int options,
+	match_callback cb, void *user, int nthreads )
+{
+	struct records rec;
+	struct record_worker *w;
+	struct context *ctx;
+	xmlTextReaderPtr reader;
+	xmlNodePtr node;
+	xmlDocPtr doc;
+	int i, ret, nw = 0, error = 0;
+
+	reader = xmlReaderForFile( filename, NULL, options );
+	if( reader == NULL )
+		return TREEXPR_EREAD;
+	if( nthreads < 1 )
+		nthreads = 1;
+	ctx = machine_context( m );
+
+	memset( &rec, 0, sizeof( rec ));
+	rec.m = m;
+	rec.cb = cb;
+	rec.user = user;
+	rec.size = nthreads * RECORDS_PER_THREAD;
+	rec.queue = zalloc( rec.size * sizeof( *rec.queue ));
+	pthread_mutex_init( &rec.lock, NULL );
+	pthread_mutex_init( &rec.cblock, NULL );
+	pthread_cond_init( &rec.more, NULL );
+	pthread_cond_init( &rec.room, NULL );
+
+	// each worker gets it's own context with the machine's budget
+	w = zalloc( nthreads * sizeof( *w ));
+	for( i = 0; i < nthreads; i++ )
+	{
+		w[i].rec = &rec;
+		w[i].ctx = new_context( );
+		w[i].ctx->steps = ctx->steps;
+		w[i].ctx->msec = ctx->msec;
+		fit_context( w[i].ctx, m );
+		w[i].started = pthread_create( &w[i].thread, NULL, record_work, &w[i] ) == 0;
+		nw += w[i].started;
+	}
+
+	// copy each record out of the reader's document, which frees it once we move past it
+	ret = xmlTextReaderRead( reader );
+	while( ret == 1 )
+	{
+		if( xmlTextReaderNodeType( reader ) != XML_READER_TYPE_ELEMENT ||
+			!xmlStrEqual( xmlTextReaderConstName( reader ), BAD_CAST record ))
+		{
+			ret = xmlTextReaderRead( reader );
+			continue;
+		}
+		node = xmlTextReaderExpand( reader );
+		if( node == NULL )
+		{
+			ret = -1;
+			break;
+		}
+		doc = xmlNewDoc( BAD_CAST "1.0" );
+		xmlDocSetRootElement( doc, xmlDocCopyNode( node, doc, 1 ));
+
+		// if none of the threads started we do it ourselves
+		if( nw == 0 )
+		{
+			run_record( &rec, w[0].ctx, doc );
+			if( rec.stop )
+				break;
+		}
+		else if( !add_record( &rec, doc ))
+			break;
+		ret = xmlTextReaderNext( reader );
+	}
+	if( ret < 0 )
+		error = 1;
+	xmlFreeTextReader( reader );
+
+	// let the workers finish what's left
+	pthread_mutex_lock( &rec.lock );
+	rec.done = 1;
+	pthread_cond_broadcast( &rec.more );
+	pthread_mutex_unlock( &rec.lock );
+	for( i = 0; i < nthreads; i++ )
+	{
+		if( w[i].started )
+			pthread_join( w[i].thread, NULL );
+		free_context( w[i].ctx );
+	}
+	free( w );
+	free( rec.queue );
+	pthread_cond_destroy( &rec.room );
+	pthread_cond_destroy( &rec.more );
+	pthread_mutex_destroy( &rec.cblock );
+	pthread_mutex_destroy( &rec.lock );
+
+	ctx->status = rec.status;
+	if( error )
+		return TREEXPR_EREAD;
+	return rec.status != 0 ? rec.status : rec.count;
+}
+
+/*
+ * Streaming
+ *
+ * A stream runs a machine over a document as it's parsed, without building the tree. Each open
+ * element has a list of runs: machines working through it's children one child at a time. When a
+ * node starts, each run over it's siblings tries it's transitions on it, and a transition with a
+ * -> starts a run of the nested machine over the node's children. When the node ends those runs
+ * are done, their results go back to the transitions that started them and the runs over the
+ * siblings move on. Every node also gets a run of the machine over just that node (a top run),
+ * and the node matches if it accepts once the node ends. So we only keep runs for the elements
+ * that are open, and matches are reported as their subtrees end (children before parents).
+ *
+ * Strings from the parser only last until it's callback returns, so top runs keep copies of the
+ * strings they capture.
+ */
+
+// a machine running over the children of an open element (or over a single node)
+struct srun
+{
+	struct srun *next; // next run over the same list of siblings
+	struct machine *m;
+	int *bits; // current state and next state bitmasks, n ints each
+	int *cur_state, *next_state;
+	unsigned int n;
+	struct srun *up; // run whose transition started us, NULL for a top run
+	struct trans *tr; // that transition
+	struct srun *root; // top run we capture for
+	struct capture *cap; // top runs: captures, by slot
+	char **own; // top runs: our copies of the captured strings, by slot
+};
+
+struct stream
+{
+	struct machine *m;
+	stream_callback cb;
+	void *user;
+	xmlParserCtxtPtr parser;
+	int html;
+	struct context *ctx;
+	struct capture *cap; // the context's own captures, put back when we're done
+	struct srun **runs; // runs over the children of each open element, [0] is the document
+	xmlChar **names; // names of the open elements
+	int nlevels, depth;
+	char *text; // characters since the last node
+	int ntext, textsize;
+	struct _xmlNode node; // node we're looking at
+	struct _xmlAttr *attr; // it's attributes
+	struct _xmlNode *val; // and their values
+	int nattrs;
+	int count; // matches so far
+	int status; // TREEXPR_STOP or TREEXPR_EBUDGET once we've stopped
+};
+
+struct srun *new_srun( struct machine *m, struct srun *up, struct trans *tr )
+{
+	struct srun *r = zalloc( sizeof( *r ));
+
+	r->m = m;
+	r->up = up;
+	r->tr = tr;
+	r->root = up != NULL ? up->root : r;
+	r->n = N( r->bits, m->states );
+	r->bits = zalloc( 2 * r->n * sizeof( *r->bits ));
+	r->cur_state = r->bits;
+	r->next_state = r->bits + r->n;
+	OR( r->cur_state, m->E[m->start->num], m->states );
+	if( up == NULL )
+	{
+		r->cap = zalloc(( m->slots + 1 ) * sizeof( *r->cap ));
+		r->own = zalloc(( m->slots + 1 ) * sizeof( *r->own ));
+	}
+	return r;
+}
+
+void free_srun( struct srun *r )
+{
+	int i;
+
+	if( r->own != NULL )
+		for( i = 0; i < r->m->slots; i++ )
+			free( r->own[i] );
+	free( r->own );
+	free( r->cap );
+	free( r->bits );
+	free( r );
+}
+
+// stops the parser, status says why
+void stop_stream( struct stream *st, int status )
+{
+	if( st->status == 0 )
+		st->status = status;
+	xmlStopParser( st->parser );
+}
+
+// copies the strings a top run has just captured, the parser is about to throw them away
+void keep_captures( struct srun *t )
+{
+	int i;
+
+	for( i = 0; i < t->m->slots; i++ )
+		if( t->cap[i].str != NULL && t->cap[i].str != t->own[i] )
+		{
+			free( t->own[i] );
+			do { t->own[i] = strdup( t->cap[i].str );
+			} while( t->own[i] == NULL );
+			t->cap[i].str = t->own[i];
+		}
+}
+
+// tries the transitions of run r on st->node, runs for -> transitions go on *below
+void stream_step( struct stream *st, struct srun *r, struct srun **below )
+{
+	struct machine *m = r->m;
+	struct context *ctx = st->ctx;
+	xmlNodePtr node = &st->node;
+	struct state *cur;
+	struct trans *tr;
+	struct srun *q;
+	size_t len = NOLEN;
+	unsigned int i;
+	int sum = 0;
+
+	memset( r->next_state, 0, r->n * sizeof( *r->next_state ));
+
+	// each node we look at counts against the budget
+	if( notbuiltin_regscratch_spend( ctx->scratch, 1 ))
+		ctx->status = TREEXPR_EBUDGET;
+	if( ctx->status != 0 )
+		return;
+
+	// are we still alive?
+	for( i = 0; i < r->n; i++ )
+		sum |= r->cur_state[i];
+	if( sum == 0 )
+		return;
+
+	ctx->cap = r->root->cap;
+	for( cur = m->start; cur != NULL; cur = cur->next )
+	{
+		tr = cur->tr;
+		if( tr == NULL || !TEST_BIT( r->cur_state, cur->num ))
+			continue;
+		if( strcmp( tr->name, "." ) != 0 &&
+			( node->name == NULL || strcasecmp( tr->name, (char *)node->name ) != 0 ))
+			continue;
+		if( tr->attrs != NULL && !attrs_process( tr, node, ctx ))
+			continue;
+		// the nested machine gets it's answer when the node ends
+		if( tr->ptr != NULL )
+		{
+			q = new_srun( tr->ptr, r, tr );
+			q->next = *below;
+			*below = q;
+			continue;
+		}
+		if( tr->re.re_magic != 0 && !regex_process( tr, (char *)node->content, &len, ctx ))
+			continue;
+		OR( r->next_state, m->E[tr->st->num], m->states );
+	}
+	keep_captures( r->root );
+}
+
+// st->node starts, own is it's name if it's an element (we free it)
+void stream_open( struct stream *st, xmlChar *own )
+{
+	struct srun *r;
+
+	if( st->depth + 1 >= st->nlevels )
+	{
+		st->nlevels *= 2;
+		st->runs = realloc( st->runs, st->nlevels * sizeof( *st->runs ));
+		st->names = realloc( st->names, st->nlevels * sizeof( *st->names ));
+	}
+
+	st->runs[st->depth + 1] = NULL;
+	st->names[st->depth] = own;
+	if( st->status == 0 )
+	{
+		// the top run for this node goes with the runs over it's siblings
+		r = new_srun( st->m, NULL, NULL );
+		r->next = st->runs[st->depth];
+		st->runs[st->depth] = r;
+
+		// the parser's strings are new each time, so the regex cache can't help us
+		forget_results( st->ctx );
+		for( ; r != NULL; r = r->next )
+			stream_step( st, r, &st->runs[st->depth + 1] );
+		if( st->ctx->status != 0 )
+			stop_stream( st, st->ctx->status );
+	}
+	st->depth++;
+}
+
+// the node at the top of the stack ends, name is what we tell the callback it's called
+void stream_close( struct stream *st, const xmlChar *name )
+{
+	struct context *ctx = st->ctx;
+	struct srun *q, *r, *next, **rp;
+	int *e, n, ret;
+
+	st->depth--;
+
+	// the runs over it's children are done, hand their answers back
+	// a -> never goes with a regex, so there's no regex to try on the node's contents
+	for( q = st->runs[st->depth + 1]; q != NULL; q = next )
+	{
+		next = q->next;
+		if( TEST_BIT( q->cur_state, q->m->final->num ) && q->tr->re.re_magic == 0 )
+			OR( q->up->next_state, q->up->m->E[q->tr->st->num], q->up->m->states );
+		free_srun( q );
+	}
+	st->runs[st->depth + 1] = NULL;
+
+	// the runs over it's siblings move on, and it's top run is done
+	for( rp = &st->runs[st->depth]; ( r = *rp ) != NULL; )
+	{
+		e = r->cur_state;
+		r->cur_state = r->next_state;
+		r->next_state = e;
+		if( r->up != NULL )
+		{
+			rp = &r->next;
+			continue;
+		}
+		*rp = r->next;
+		if( TEST_BIT( r->cur_state, st->m->final->num ) && st->status == 0 )
+		{
+			ctx->cap = r->cap;
+			n = find_matches( st->m, ctx );
+			st->count++;
+			ret = st->cb( (const char *)name, st->depth, n > 0 ? ctx->re : NULL, n, st->user );
+			if( ret == TREEXPR_STOP )
+				stop_stream( st, TREEXPR_STOP );
+		}
+		free_srun( r );
+	}
+}
+
+// a node without children
+void stream_leaf( struct stream *st, const xmlChar *name, const char *content )
+{
+	st->node.name = name;
+	st->node.content = (xmlChar *)content;
+	st->node.properties = NULL;
+	stream_open( st, NULL );
+	stream_close( st, name );
+}
+
+// characters become a text node once something else comes along
+void stream_text( struct stream *st )
+{
+	if( st->ntext == 0 )
+		return;
+	st->text[st->ntext] = '\0';
+	st->ntext = 0;
+	stream_leaf( st, BAD_CAST "text", st->text );
+}
+
+void stream_characters( void *user, const xmlChar *ch, int len )
+{
+	struct stream *st = user;
+
+	if( st->ntext + len + 1 > st->textsize )
+	{
+		while( st->ntext + len + 1 > st->textsize )
+			st->textsize *= 2;
+		st->text = realloc( st->text, st->textsize );
+	}
+	memcpy( st->text + st->ntext, ch, len );
+	st->ntext += len;
+}
+
+void stream_start_element( void *user, const xmlChar *name, const xmlChar **atts )
+{
+	struct stream *st = user;
+	int i, n = 0;
+
+	stream_text( st );
+
+	// dress the attributes up like the tree would have them
+	for( n = 0; atts != NULL && atts[2 * n] != NULL; n++ )
+		;
+	if( n > st->nattrs )
+	{
+		st->nattrs = n;
+		st->attr = realloc( st->attr, n * sizeof( *st->attr ));
+		st->val = realloc( st->val, n * sizeof( *st->val ));
+	}
+	for( i = 0; i < n; i++ )
+	{
+		memset( &st->attr[i], 0, sizeof( st->attr[i] ));
+		memset( &st->val[i], 0, sizeof( st->val[i] ));
+		st->attr[i].name = atts[2 * i];
+		st->attr[i].next = i + 1 < n ? &st->attr[i + 1] : NULL;
+		if( atts[2 * i + 1] != NULL )
+		{
+			st->attr[i].children = &st->val[i];
+			st->val[i].content = (xmlChar *)atts[2 * i + 1];
+		}
+	}
+	st->node.name = name;
+	st->node.content = NULL;
+	st->node.properties = n > 0 ? st->attr : NULL;
+	stream_open( st, xmlStrdup( name ));
+}
+
+void stream_end_element( void *user, const xmlChar *name )
+{
+	struct stream *st = user;
+	xmlChar *own;
+
+	stream_text( st );
+	if( st->depth > 0 )
+	{
+		own = st->names[st->depth - 1];
+		stream_close( st, own );
+		xmlFree( own );
+	}
+}
+
+void stream_comment( void *user, const xmlChar *value )
+{
+	struct stream *st = user;
+
+	stream_text( st );
+	stream_leaf( st, BAD_CAST "comment", (const char *)value );
+}
+
+// CDATA sections (and the contents of <script> and <style> in HTML) don't have a name
+void stream_cdata( void *user, const xmlChar *value, int len )
+{
+	struct stream *st = user;
+	char *s;
+
+	stream_text( st );
+	s = zalloc( len + 1 );
+	memcpy( s, value, len );
+	stream_leaf( st, NULL, s );
+	free( s );
+}
+
+void stream_pi( void *user, const xmlChar *target, const xmlChar *data )
+{
+	struct stream *st = user;
+
+	stream_text( st );
+	stream_leaf( st, target, (const char *)data );
+}
+
+void stream_end_document( void *user )
+{
+	stream_text( user );
+}
+
+// starts streaming a document (HTML if html is true, XML otherwise) through machine m, you feed
+// it with stream_push() and finish with stream_finish()
+// options are libxml2 parser options, like the ones for htmlReadFile()
+// cb is called for each match as it's subtree ends, so children come before their parents, and
+// it gets the node's name and depth instead of the node
+struct stream *new_stream( struct machine *m, int html, int options, stream_callback cb, void *user )
+{
+	struct stream *st = zalloc( sizeof( struct stream ));
+	xmlSAXHandler sax;
+
+	st->m = m;
+	st->cb = cb;
+	st->user = user;
+	st->html = html;
+
+	if( !m->interned )
+		intern_regexes( &m, 1 );
+	prepare_machine( m );
+	st->ctx = new_context( );
+	fit_context( st->ctx, m );
+	st->cap = st->ctx->cap;
+	if( m->ctx != NULL )
+	{
+		st->ctx->steps = m->ctx->steps;
+		st->ctx->msec = m->ctx->msec;
+	}
+	begin_document( st->ctx );
+
+	st->nlevels = 16;
+	st->runs = zalloc( st->nlevels * sizeof( *st->runs ));
+	st->names = zalloc( st->nlevels * sizeof( *st->names ));
+	st->textsize = 256;
+	st->text = zalloc( st->textsize );
+
+	// SAX1 callbacks, HTML leaves out ignorable white space just like it does building a tree
+	memset( &sax, 0, sizeof( sax ));
+	sax.startElement = stream_start_element;
+	sax.endElement = stream_end_element;
+	sax.characters = stream_characters;
+	sax.ignorableWhitespace = html ? NULL : stream_characters;
+	sax.cdataBlock = stream_cdata;
+	sax.comment = stream_comment;
+	sax.processingInstruction = stream_pi;
+	sax.endDocument = stream_end_document;
+	if( html )
+	{
+		st->parser = htmlCreatePushParserCtxt( (htmlSAXHandlerPtr)&sax, st, NULL, 0, NULL,
+			XML_CHAR_ENCODING_NONE );
+		htmlCtxtUseOptions( st->parser, options );
+	}
+	else
+	{
+		st->parser = xmlCreatePushParserCtxt( &sax, st, NULL, 0, NULL );
+		xmlCtxtUseOptions( st->parser, options );
+	}
+	return st;
+}
+
+// parses the next len bytes of the document
+// returns TREEXPR_CONTINUE, or TREEXPR_STOP or TREEXPR_EBUDGET once the stream has stopped
+int stream_push( struct stream *st, const char *buf, int len )
+{
+	if( st->status == 0 )
+	{
+		if( st->html )
+			htmlParseChunk( st->parser, buf, len, 0 );
+		else
+			xmlParseChunk( st->parser, buf, len, 0 );
+	}
+	return st->status;
+}
+
+// tells the stream the document is over
+// returns the number of matches, or TREEXPR_EBUDGET if we went over budget
+int stream_finish( struct stream *st )
+{
+	if( st->status == 0 )
+	{
+		if( st->html )
+			htmlParseChunk( st->parser, NULL, 0, 1 );
+		else
+			xmlParseChunk( st->parser, NULL, 0, 1 );
+	}
+	return st->status == TREEXPR_EBUDGET ? st->status : st->count;
+}
+
+void free_stream( struct stream *st )
+{
+	struct srun *r, *next;
+	int i;
+
+	if( st == NULL )
+		return;
+	for( i = 0; i <= st->depth; i++ )
+		for( r = st->runs[i]; r != NULL; r = next )
+		{
+			next = r->next;
+			free_srun( r );
+		}
+	for( i = 0; i < st->depth; i++ )
+		xmlFree( st->names[i] );
+	free( st->runs );
+	free( st->names );
+	free( st->text );
+	free( st->attr );
+	free( st->val );
+	st->ctx->cap = st->cap;
+	free_context( st->ctx );
+	if( st->html )
+		htmlFreeParserCtxt( st->parser );
+	else
+		xmlFreeParserCtxt( st->parser );
+	free( st );
+}
+
+/*
+ * Pattern sets
+ *
+ * A pattern set runs many machines over a document in a single traversal. A machine can only
+ * match a node if one of the transitions out of E(start) matches the node's name, so we index
+ * the patterns by those names and only run the ones that can possibly match each node.
+ */
+
+struct pattern_set *new_pattern_set( void )
+{
+	return zalloc( sizeof( struct pattern_set ));
+}
+
+void free_literal_set( struct literal_set *ls );
+
+// throw away the index of first symbols and the prefilter, they get rebuilt when needed
+void free_first( struct pattern_set *ps )
+{
+	free( ps->first );
+	free( ps->any );
+	free( ps->cand );
+	ps->first = NULL;
+	ps->any = ps->cand = NULL;
+	ps->nfirst = ps->nany = 0;
+	free_literal_set( ps->ls );
+	ps->ls = NULL;
+}
+
+// adds a machine to a pattern set, the set takes care of freeing it
+void pattern_set_add( struct pattern_set *ps, int id, struct machine *m )
+{
+	if( ps->n >= ps->size )
+	{
+		ps->size = ps->size ? ps->size * 2 : 16;
+		ps->m = realloc( ps->m, ps->size * sizeof( *ps->m ));
+		ps->id = realloc( ps->id, ps->size * sizeof( *ps->id ));
+	}
+	ps->m[ps->n] = m;
+	ps->id[ps->n] = id;
+	ps->n++;
+	free_first( ps );
+}
+
+void free_pattern_set( struct pattern_set *ps )
+{
+	int i;
+
+	if( ps == NULL )
+		return;
+	for( i = 0; i < ps->n; i++ )
+		free_machine( ps->m[i] );
+	free( ps->m );
+	free( ps->id );
+	free_first( ps );
+	free_context( ps->ctx );
+	free( ps );
+}
+
+// sorts the index by name, then by pattern so candidates come out in the order they were added
+int first_cmp( const void *a, const void *b )
+{
+	const struct first *x = a, *y = b;
+	int r;
+
+	r = strcasecmp( x->name, y->name );
+	return r != 0 ? r : x->pat - y->pat;
+}
+
+// finds the distinct names a machine's root node can match (the transitions out of E(start))
+// returns how many there are, names gets them (free it), or -1 if one of them is "."
+int machine_first( struct machine *m, char ***names )
+{
+	struct state *cur;
+	int j, n = 0;
+
+	prepare_machine( m );
+	*names = zalloc( m->states * sizeof( **names ));
+	for( cur = m->start; cur != NULL; cur = cur->next )
+	{
+		if( !TEST_BIT( m->E[m->start->num], cur->num ) || cur->tr == NULL )
+			continue;
+		if( strcmp( cur->tr->name, "." ) == 0 )
+		{
+			free( *names );
+			*names = NULL;
+			return -1;
+		}
+		for( j = 0; j < n; j++ )
+			if( strcasecmp( (*names)[j], cur->tr->name ) == 0 )
+				break;
+		if( j == n )
+			(*names)[n++] = cur->tr->name;
+	}
+	return n;
+}
+
+// build the index of first symbols
+void build_first( struct pattern_set *ps )
+{
+	char **names;
+	int i, j, n, size = 0;
+
+	ps->any = zalloc(( ps->n + 1 ) * sizeof( *ps->any ));
+	ps->cand = zalloc(( ps->n + 1 ) * sizeof( *ps->cand ));
+	for( i = 0; i < ps->n; i++ )
+	{
+		// if any transition out of E(start) is "." this pattern goes on the any list
+		n = machine_first( ps->m[i], &names );
+		if( n < 0 )
+		{
+			ps->any[ps->nany++] = i;
+			continue;
+		}
+
+		// otherwise index each distinct name
+		for( j = 0; j < n; j++ )
+		{
+			if( ps->nfirst >= size )
+			{
+				size = size ? size * 2 : 64;
+				ps->first = realloc( ps->first, size * sizeof( *ps->first ));
+			}
+			ps->first[ps->nfirst].name = names[j];
+			ps->first[ps->nfirst].pat = i;
+			ps->nfirst++;
+		}
+		free( names );
+	}
+	if( ps->first == NULL )
+		ps->first = zalloc( sizeof( *ps->first ));
+	qsort( ps->first, ps->nfirst, sizeof( *ps->first ), first_cmp );
+
+	// patterns often share regexes, give them all the same cache keys
+	intern_regexes( ps->m, ps->n );
+}
+
+// fills ps->cand with the patterns that might match a node, in the order they were added
+int find_candidates( struct pattern_set *ps, xmlNodePtr node )
+{
+	int lo = 0, hi = ps->nfirst, mid, i = 0, n = 0;
+
+	// binary search for the first entry with this name
+	if( node->name != NULL )
+	{
+		while( lo < hi )
+		{
+			mid = ( lo + hi ) / 2;
+			if( strcasecmp( ps->first[mid].name, (char *)node->name ) < 0 )
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+	else
+		lo = ps->nfirst;
+
+	// merge those entries with the any list
+	while( i < ps->nany || ( lo < ps->nfirst
+		&& strcasecmp( ps->first[lo].name, (char *)node->name ) == 0 ))
+	{
+		if( i < ps->nany && ( lo >= ps->nfirst
+			|| strcasecmp( ps->first[lo].name, (char *)node->name ) != 0
+			|| ps->any[i] < ps->first[lo].pat ))
+			ps->cand[n] = ps->any[i++];
+		else
+			ps->cand[n] = ps->first[lo++].pat;
+
+		// leave out patterns the prefilter ruled out
+		if( ps->mask == NULL || ps->mask[ps->cand[n]] )
+			n++;
+	}
+	return n;
+}
+
+// runs each candidate pattern on each xml node at this level, then recurses to it's children
+// returns TREEXPR_STOP if the callback asked us to stop
+int set_recurse( struct pattern_set *ps, xmlNodePtr node, set_callback cb, void *user,
+	int *count, struct context *ctx )
+{
+	xmlNodePtr cur = node;
+	struct machine *m;
+	int i, n, ncand, ret, skip, stop = 0, base = ctx->sp;
+
+	for( ;; )
+	{
+		// at the end of a list of children go back to the parent's next sibling
+		if( cur == NULL )
+		{
+			if( ctx->sp == base )
+				return TREEXPR_CONTINUE;
+			cur = ctx->nodes[--ctx->sp];
+			continue;
+		}
+		skip = 0;
+		ncand = find_candidates( ps, cur );
+		for( i = 0; i < ncand; i++ )
+		{
+			m = ps->m[ps->cand[i]];
+			ret = node_process( m, cur, ctx );
+			if( ctx->status != 0 )
+			{
+				stop = 1;
+				break;
+			}
+			if( !ret )
+				continue;
+			n = find_matches( m, ctx );
+			( *count )++;
+			ret = cb( ps->id[ps->cand[i]], cur, n > 0 ? ctx->re : NULL, n, user );
+			if( ret == TREEXPR_STOP )
+			{
+				stop = 1;
+				break;
+			}
+			if( ret == TREEXPR_SKIP )
+				skip = 1;
+		}
+		if( stop )
+			break;
+		if( skip )
+		{
+			cur = cur->next;
+			continue;
+		}
+		// go down to the children
+		push_node( ctx, cur->next );
+		cur = cur->children;
+	}
+	ctx->sp = base;
+	return TREEXPR_STOP;
+}
+
+// run the patterns in a set that are marked in cand (or all of them if cand is NULL) on each
+// node in an xml document in one pass, and call cb for each match in document order
+// matches on the same node come in the order the patterns were added
+// returns the number of matches
+int pattern_set_run_cb( struct pattern_set *ps, xmlDocPtr doc, const char *cand,
+	set_callback cb, void *user )
+{
+	int i, count = 0;
+
+	if( ps->first == NULL )
+		build_first( ps );
+	if( ps->ctx == NULL )
+		ps->ctx = new_context();
+	for( i = 0; i < ps->n; i++ )
+		fit_context( ps->ctx, ps->m[i] );
+	begin_document( ps->ctx );
+	ps->mask = cand;
+	set_recurse( ps, doc->children->next, cb, user, &count, ps->ctx );
+	ps->mask = NULL;
+	return ps->ctx->status != 0 ? ps->ctx->status : count;
+}
+
+// run every pattern in a set on an xml document
+int pattern_set_process_cb( struct pattern_set *ps, xmlDocPtr doc, set_callback cb, void *user )
+{
+	return pattern_set_run_cb( ps, doc, NULL, cb, user );
+}
+
+// appends a match to a list (in document order)
+int set_list_callback( int id, xmlNodePtr node, struct regex_match *re, int nre, void *user )
+{
+	struct limit_callback *lc = user;
+
+	limit_callback( node, re, nre, user );
+	lc->tail->id = id;
+	return TREEXPR_CONTINUE;
+}
+
+// run the patterns in a set that are marked in cand (or all of them if cand is NULL) on an
+// xml document and return a list of matches in document order
+struct match *pattern_set_run( struct pattern_set *ps, xmlDocPtr doc, const char *cand )
+{
+	struct limit_callback lc;
+
+	lc.head = lc.tail = NULL;
+	lc.n = 0;
+	lc.max = 0;
+	pattern_set_run_cb( ps, doc, cand, set_list_callback, &lc );
+	return lc.head;
+}
+
+// run every pattern in a set on an xml document and return a list of matches in document order
+struct match *pattern_set_process( struct pattern_set *ps, xmlDocPtr doc )
+{
+	return pattern_set_run( ps, doc, NULL );
+}
+
+// like machine_budget(), for each run of the set as a whole
+void pattern_set_budget( struct pattern_set *ps, long steps, long msec )
+{
+	if( ps->ctx == NULL )
+		ps->ctx = new_context();
+	ps->ctx->steps = steps;
+	ps->ctx->msec = msec;
+}
+
+// returns TREEXPR_EBUDGET if the last run of the set went over budget, 0 otherwise
+int pattern_set_status( struct pattern_set *ps )
+{
+	return ps->ctx != NULL ? ps->ctx->status : 0;
+}
+
+/*
+ * Document index
+ *
+ * Running lots of machines over the same document, each one walks the whole tree just to find
+ * the few nodes it could start on. An index numbers the nodes once in preorder and postorder, so
+ * a is an ancestor of b iff pre(a) < pre(b) and post(a) > post(b), and keeps a list of the nodes
+ * with each name. A machine then only has to be tried on the nodes named in it's first set. It
+ * also remembers the length of each node's content and attribute values, so the regexes don't
+ * have to work them out again for each machine.
+ */
+
+#define INDEX_HASH( key )	(((size_t)( key ) >> 3 ) * 0x9e3779b1 )
+
+// finds the slot for a node or string, empty if it isn't in the index
+struct index_slot *index_slot( struct doc_index *idx, const void *key )
+{
+	unsigned int i;
+
+	for( i = INDEX_HASH( key ) & ( idx->size - 1 ); ; i = ( i + 1 ) & ( idx->size - 1 ))
+		if( idx->slot[i].key == key || idx->slot[i].key == NULL )
+			return &idx->slot[i];
+}
+
+void index_add( struct doc_index *idx, const void *key, int pre, size_t len )
+{
+	struct index_slot *s = index_slot( idx, key );
+
+	s->key = key;
+	s->pre = pre;
+	s->len = len;
+}
+
+// does a node have content we should remember the length of
+// (declarations under a DTD aren't really xmlNodes, so we leave them alone)
+int index_text( xmlNodePtr node )
+{
+	switch( node->type )
+	{
+	case XML_TEXT_NODE:
+	case XML_CDATA_SECTION_NODE:
+	case XML_COMMENT_NODE:
+	case XML_PI_NODE:
+		return node->content != NULL;
+	default:
+		return 0;
+	}
+}
+
+// sorts nodes by name, then document order
+int tag_cmp( const void *a, const void *b )
+{
+	const struct index_tag *x = a, *y = b;
+	int r;
+
+	r = strcasecmp( x->name, y->name );
+	return r != 0 ? r : x->pre - y->pre;
+}
+
+// numbers and sorts out the nodes document_process would visit, the document mustn't change
+// while the index is in use
+struct doc_index *treexpr_index_doc( xmlDocPtr doc )
+{
+	struct doc_index *idx = zalloc( sizeof( struct doc_index ));
+	struct _xmlAttr *attr;
+	xmlNodePtr cur;
+	int *stack = NULL, sp = 0, nstack = 0, size = 0, npost = 0, nkeys = 0, i;
+
+	// preorder numbers go up on the way down and postorder numbers on the way back up
+	cur = doc->children != NULL ? doc->children->next : NULL;
+	while( cur != NULL )
+	{
+		if( idx->n >= size )
+		{
+			size = size ? size * 2 : 256;
+			idx->node = realloc( idx->node, size * sizeof( *idx->node ));
+			idx->post = realloc( idx->post, size * sizeof( *idx->post ));
+		}
+		idx->node[idx->n] = cur;
+		nkeys++;
+		if( index_text( cur ))
+			nkeys++;
+		if( cur->type == XML_ELEMENT_NODE )
+			for( attr = cur->properties; attr != NULL; attr = attr->next )
+				nkeys++;
+		if( cur->children != NULL )
+		{
+			if( sp >= nstack )
+			{
+				nstack = nstack ? nstack * 2 : 64;
+				stack = realloc( stack, nstack * sizeof( *stack ));
+			}
+			stack[sp++] = idx->n++;
+			cur = cur->children;
+			continue;
+		}
+		idx->post[idx->n++] = npost++;
+		while( cur->next == NULL && sp > 0 )
+		{
+			i = stack[--sp];
+			cur = idx->node[i];
+			idx->post[i] = npost++;
+		}
+		cur = cur->next;
+	}
+	free( stack );
+
+	// the hash table of nodes and strings, at most half full
+	for( idx->size = 16; idx->size < 2 * nkeys; idx->size *= 2 )
+		;
+	idx->slot = zalloc( idx->size * sizeof( *idx->slot ));
+	idx->tag = zalloc(( idx->n + 1 ) * sizeof( *idx->tag ));
+	idx->cand = zalloc(( idx->n + 1 ) * sizeof( *idx->cand ));
+	for( i = 0; i < idx->n; i++ )
+	{
+		cur = idx->node[i];
+		index_add( idx, cur, i, 0 );
+		if( index_text( cur ))
+			index_add( idx, cur->content, i, strlen( (char *)cur->content ));
+		if( cur->type == XML_ELEMENT_NODE )
+			for( attr = cur->properties; attr != NULL; attr = attr->next )
+				if( attr->children != NULL && attr->children->content != NULL )
+					index_add( idx, attr->children->content, i,
+						strlen( (char *)attr->children->content ));
+		if( cur->name != NULL )
+		{
+			idx->tag[idx->ntags].name = (char *)cur->name;
+			idx->tag[idx->ntags].pre = i;
+			idx->ntags++;
+		}
+	}
+	qsort( idx->tag, idx->ntags, sizeof( *idx->tag ), tag_cmp );
+	return idx;
+}
+
+void free_doc_index( struct doc_index *idx )
+{
+	if( idx == NULL )
+		return;
+	free( idx->node );
+	free( idx->post );
+	free( idx->tag );
+	free( idx->slot );
+	free( idx->cand );
+	free( idx );
+}
+
+// length of a string from the indexed document, or any other string
+size_t index_strlen( struct doc_index *idx, const char *str )
+{
+	struct index_slot *s = index_slot( idx, str );
+
+	return s->key != NULL ? s->len : strlen( str );
+}
+
+// returns true iff a is an ancestor of b, both in the index
+int index_ancestor( struct doc_index *idx, xmlNodePtr a, xmlNodePtr b )
+{
+	struct index_slot *x = index_slot( idx, a ), *y = index_slot( idx, b );
+
+	if( x->key == NULL || y->key == NULL )
+		return 0;
+	return x->pre < y->pre && idx->post[x->pre] > idx->post[y->pre];
+}
+
+int int_cmp( const void *a, const void *b )
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+// fills idx->cand with the nodes a machine might match, in document order
+// returns how many there are, or -1 if it might match any node
+int index_candidates( struct doc_index *idx, struct machine *m )
+{
+	char **names;
+	int i, lo, hi, mid, n = 0, nnames;
+
+	nnames = machine_first( m, &names );
+	if( nnames < 0 )
+		return -1;
+	for( i = 0; i < nnames; i++ )
+	{
+		// binary search for the first node with this name
+		lo = 0;
+		hi = idx->ntags;
+		while( lo < hi )
+		{
+			mid = ( lo + hi ) / 2;
+			if( strcasecmp( idx->tag[mid].name, names[i] ) < 0 )
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for( ; lo < idx->ntags && strcasecmp( idx->tag[lo].name, names[i] ) == 0; lo++ )
+			idx->cand[n++] = idx->tag[lo].pre;
+	}
+	free( names );
+
+	// the names are all different, so we just need to put them back in document order
+	if( nnames > 1 )
+		qsort( idx->cand, n, sizeof( *idx->cand ), int_cmp );
+	return n;
+}
+
+// like document_process_cb, for the document in an index
+// only the nodes the machine could start on get visited
+int index_process_cb( struct machine *m, struct doc_index *idx, match_callback cb, void *user )
+{
+	struct count_callback cc;
+	struct context *ctx;
+	xmlNodePtr cur;
+	int i, n, ncand, ret, skip = -1;
+
+	cc.cb = cb;
+	cc.user = user;
+	cc.n = 0;
+	ctx = machine_context( m );
+	ncand = index_candidates( idx, m );
+	if( ncand < 0 )
+	{
+		// it starts with ".", so every node's a candidate
+		if( idx->n > 0 )
+		{
+			ctx->index = idx;
+			node_recurse( m, idx->node[0], NULL, count_callback, &cc, ctx );
+			ctx->index = NULL;
+		}
+		return ctx->status != 0 ? ctx->status : cc.n;
+	}
+
+	ctx->index = idx;
+	for( i = 0; i < ncand; i++ )
+	{
+		// leave out nodes below one the callback told us to skip
+		if( skip >= 0 && idx->post[idx->cand[i]] < idx->post[skip] )
+			continue;
+		skip = -1;
+		cur = idx->node[idx->cand[i]];
+		ret = node_process( m, cur, ctx );
+		if( ctx->status != 0 )
+			break;
+		if( !ret )
+			continue;
+		n = find_matches( m, ctx );
+		ret = count_callback( cur, n > 0 ? ctx->re : NULL, n, &cc );
+		if( ret == TREEXPR_STOP )
+			break;
+		if( ret == TREEXPR_SKIP )
+			skip = idx->cand[i];
+	}
+	ctx->index = NULL;
+	return ctx->status != 0 ? ctx->status : cc.n;
+}
+
+// like document_process, for the document in an index
+struct match *index_process( struct machine *m, struct doc_index *idx )
+{
+	struct match *n = NULL;
+
+	index_process_cb( m, idx, list_callback, &n );
+	return n;
+}
+
+/*
+ * Snapshots
+ *
+ * A libxml node is big and full of pointers we never look at. A snapshot copies out just what
+ * the matcher needs: an array of small nodes in document order that point at each other by
+ * number, names turned into tags (numbers that are the same for names that are the same ignoring
+ * case) and all the strings in one block. A run looks up the tag of each name in the machine
+ * once, after that names are compared as numbers. Nothing writes to a snapshot once it's made,
+ * so any number of threads can run machines over it at once.
+ */
+
+#define SNAP_HASH_FOLD( h, c )	((( h ) ^ (unsigned char)tolower( c )) * 16777619u )
+
+// finds the tag for a name, or where it goes in the hash table
+unsigned int snap_slot( struct snapshot *s, const char *name, int len )
+{
+	unsigned int h = 2166136261u, i;
+	const char *t;
+	int j;
+
+	for( j = 0; j < len; j++ )
+		h = SNAP_HASH_FOLD( h, name[j] );
+	for( i = h & ( s->hsize - 1 ); s->hash[i] != 0; i = ( i + 1 ) & ( s->hsize - 1 ))
+	{
+		t = s->text + s->tag[s->hash[i] - 1];
+		if( strncasecmp( t, name, len ) == 0 && t[len] == '\0' )
+			break;
+	}
+	return i;
+}
+
+// returns the tag for a name, or SNAP_NONE if there's no such tag
+int snapshot_tag( struct snapshot *s, const char *name )
+{
+	unsigned int i;
+
+	if( s->hsize == 0 )
+		return SNAP_NONE;
+	i = snap_slot( s, name, strlen( name ));
+	return s->hash[i] != 0 ? s->hash[i] - 1 : SNAP_NONE;
+}
+
+// copies a string into the snapshot's text, returns where it starts
+int snap_text( struct snapshot *s, const char *str, int len )
+{
+	int off = s->ntext;
+
+	if( s->ntext + len + 1 > s->tsize )
+	{
+		while( s->ntext + len + 1 > s->tsize )
+			s->tsize = s->tsize ? s->tsize * 2 : 4096;
+		s->text = realloc( s->text, s->tsize );
+	}
+	memcpy( s->text + s->ntext, str, len );
+	s->text[s->ntext + len] = '\0';
+	s->ntext += len + 1;
+	return off;
+}
+
+// returns the tag for a name, making one if we have to
+int snap_intern( struct snapshot *s, const char *name, int len )
+{
+	unsigned int i, size;
+	int *old, j;
+
+	// keep the table at most half full
+	if(( s->ntags + 1 ) * 2 > s->hsize )
+	{
+		old = s->hash;
+		size = s->hsize;
+		s->hsize = size ? size * 2 : 64;
+		s->hash = zalloc( s->hsize * sizeof( *s->hash ));
+		for( j = 0; j < s->ntags; j++ )
+			s->hash[snap_slot( s, s->text + s->tag[j], strlen( s->text + s->tag[j] ))] = j + 1;
+		free( old );
+	}
+	i = snap_slot( s, name, len );
+	if( s->hash[i] == 0 )
+	{
+		if( s->ntags >= s->tagsize )
+		{
+			s->tagsize = s->tagsize ? s->tagsize * 2 : 64;
+			s->tag = realloc( s->tag, s->tagsize * sizeof( *s->tag ));
+		}
+		s->tag[s->ntags] = snap_text( s, name, len );
+		s->hash[i] = ++s->ntags;
+	}
+	return s->hash[i] - 1;
+}
+
+// adds a node with a name (or NULL) and no children, returns it's number
+int snap_node( struct snapshot *s, const char *name, int len )
+{
+	struct snap_node *n;
+
+	if( s->n >= s->nsize )
+	{
+		s->nsize = s->nsize ? s->nsize * 2 : 256;
+		s->node = realloc( s->node, s->nsize * sizeof( *s->node ));
+		s->src = realloc( s->src, s->nsize * sizeof( *s->src ));
+	}
+	n = &s->node[s->n];
+	n->name = name != NULL ? snap_intern( s, name, len ) : -1;
+	n->child = n->next = n->attr = n->text = -1;
+	n->len = 0;
+	n->end = s->n + 1;
+	s->src[s->n] = NULL;
+	return s->n++;
+}
+
+// adds an attribute to the last node, value can be NULL
+void snap_attr( struct snapshot *s, const char *name, int len, const char *value, int vlen )
+{
+	struct snap_attr *a;
+
+	if( s->nattrs >= s->asize )
+	{
+		s->asize = s->asize ? s->asize * 2 : 64;
+		s->attr = realloc( s->attr, s->asize * sizeof( *s->attr ));
+	}
+	if( s->node[s->n - 1].attr < 0 )
+		s->node[s->n - 1].attr = s->nattrs;
+	else
+		s->attr[s->nattrs - 1].more = 1;
+	a = &s->attr[s->nattrs++];
+	a->name = snap_intern( s, name, len );
+	a->text = value != NULL ? snap_text( s, value, vlen ) : -1;
+	a->len = vlen;
+	a->more = 0;
+}
+
+// makes a snapshot of the nodes document_process would visit
+struct snapshot *treexpr_snapshot( xmlDocPtr doc )
+{
+	struct snapshot *s = zalloc( sizeof( struct snapshot ));
+	struct _xmlAttr *attr;
+	xmlNodePtr cur;
+	const char *v;
+	int *open = NULL, *last = NULL, sp = 0, nstack = 0, i;
+
+	// last[sp] is the last node we added at depth sp, open[sp] is it's parent
+	nstack = 64;
+	open = zalloc( nstack * sizeof( *open ));
+	last = zalloc( nstack * sizeof( *last ));
+	last[0] = -1;
+	cur = doc->children != NULL ? doc->children->next : NULL;
+	while( cur != NULL )
+	{
+		i = snap_node( s, (char *)cur->name, cur->name != NULL ? strlen( (char *)cur->name ) : 0 );
+		s->src[i] = cur;
+		if( index_text( cur ))
+		{
+			s->node[i].len = strlen( (char *)cur->content );
+			s->node[i].text = snap_text( s, (char *)cur->content, s->node[i].len );
+		}
+		if( cur->type == XML_ELEMENT_NODE )
+			for( attr = cur->properties; attr != NULL; attr = attr->next )
+			{
+				v = attr->children != NULL ? (char *)attr->children->content : NULL;
+				snap_attr( s, (char *)attr->name, strlen( (char *)attr->name ), v,
+					v != NULL ? strlen( v ) : 0 );
+			}
+		if( last[sp] >= 0 )
+			s->node[last[sp]].next = i;
+		else if( sp > 0 )
+			s->node[open[sp]].child = i;
+		last[sp] = i;
+
+		if( cur->children != NULL )
+		{
+			if( sp + 1 >= nstack )
+			{
+				nstack *= 2;
+				open = realloc( open, nstack * sizeof( *open ));
+				last = realloc( last, nstack * sizeof( *last ));
+			}
+			sp++;
+			open[sp] = i;
+			last[sp] = -1;
+			cur = cur->children;
+			continue;
+		}
+		// back up to the next node that has a next sibling
+		while( cur->next == NULL && sp > 0 )
+		{
+			s->node[open[sp]].end = s->n;
+			cur = s->src[open[sp--]];
+		}
+		cur = cur->next;
+	}
+	free( open );
+	free( last );
+	return s;
+}
+
+void free_snapshot( struct snapshot *s )
+{
+	if( s == NULL )
+		return;
+	free( s->node );
+	free( s->src );
+	free( s->attr );
+	free( s->text );
+	free( s->tag );
+	free( s->hash );
+	free( s );
+}
+
+// returns a node's name, NULL if it doesn't have one
+const char *snapshot_name( struct snapshot *s, int node )
+{
+	return s->node[node].name >= 0 ? s->text + s->tag[s->node[node].name] : NULL;
+}
+
+// returns a node's contents and sets len to their length, NULL if it doesn't have any
+const char *snapshot_content( struct snapshot *s, int node, int *len )
+{
+	*len = s->node[node].len;
+	return s->node[node].text >= 0 ? s->text + s->node[node].text : NULL;
+}
+
+// finds the attribute of a snapshot node with the same tag as attr
+int snap_find_attr( struct context *ctx, struct snap_node *node, struct attribute *attr,
+	char **value, size_t *len )
+{
+	struct snap_attr *a;
+
+	if( node->attr < 0 )
+		return 0;
+	for( a = ctx->snap->attr + node->attr; ; a++ )
+	{
+		if( a->name == ctx->tag[attr->sym] )
+		{
+			*value = a->text >= 0 ? ctx->snap->text + a->text : NULL;
+			*len = a->len;
+			return 1;
+		}
+		if( !a->more )
+			return 0;
+	}
+}
+
+// the matcher for snapshots
+#define PUSH_FRAME			snap_push_frame
+#define TREE_PROCESS		snap_tree_process
+#define NODE_PROCESS		snap_node_process
+#define ATTRS_PROCESS		snap_attrs_process
+#define NODE				struct snap_node *
+#define NAME_OK( ctx, tr, n )	( ctx->tag[( tr )->sym] == ( n )->name \
+	|| ctx->tag[( tr )->sym] == SNAP_ANY )
+#define CHILDREN( ctx, n )	(( n )->child >= 0 ? ( ctx )->snap->node + ( n )->child : NULL )
+#define NEXT( ctx, n )		(( n )->next >= 0 ? ( ctx )->snap->node + ( n )->next : NULL )
+#define CONTENT( ctx, n )	(( n )->text >= 0 ? ( ctx )->snap->text + ( n )->text : NULL )
+#define CONTENT_LEN( ctx, n )	((size_t)( n )->len )
+#define FIND_ATTR( ctx, n, attr, v, l )	snap_find_attr( ctx, n, attr, v, l )
+
+#include "treewalk.c"
+
+// looks up the tags for the names in a machine and the machines nested in it, using the
+// lookup function of a tree adapter
+void bind_tags( struct context *ctx, struct machine *m, int (*tag)( void *tree, const char *name ),
+	void *tree )
+{
+	struct state *cur;
+	struct attribute *attr;
+	int t;
+
+	for( cur = m->start; cur != NULL; cur = cur->next )
+	{
+		if( cur->tr == NULL )
+			continue;
+		if( strcmp( cur->tr->name, "." ) == 0 )
+			ctx->tag[cur->tr->sym] = SNAP_ANY;
+		else
+		{
+			t = tag( tree, cur->tr->name );
+			ctx->tag[cur->tr->sym] = t >= 0 ? t : SNAP_NONE;
+		}
+		for( attr = cur->tr->attrs; attr != NULL; attr = attr->next )
+		{
+			t = tag( tree, attr->name );
+			ctx->tag[attr->sym] = t >= 0 ? t : SNAP_NONE;
+		}
+		if( cur->tr->ptr != NULL )
+			bind_tags( ctx, cur->tr->ptr, tag, tree );
+	}
+}
+
+// snapshot_tag() for bind_tags() and the libxml adapter
+int snap_tag( void *tree, const char *name )
+{
+	return snapshot_tag( tree, name );
+}
+
+// works out the tags a machine can start on for a tree with ntags tags, ctx->start gets them
+// by tag + 1 so nodes without a name fit in
+void start_tags( struct context *ctx, struct machine *m, int ntags,
+	int (*tag)( void *tree, const char *name ), void *tree )
+{
+	char **names;
+	int i, n, t;
+
+	if( ctx->nstart < ntags + 1 )
+	{
+		free( ctx->start );
+		ctx->nstart = ntags + 1;
+		ctx->start = zalloc( ctx->nstart );
+	}
+	// a machine that starts with "." can start anywhere
+	n = machine_first( m, &names );
+	memset( ctx->start, n < 0 ? 1 : 0, ntags + 1 );
+	for( i = 0; i < n; i++ )
+		if(( t = tag( tree, names[i] )) >= 0 )
+			ctx->start[t + 1] = 1;
+	free( names );
+}
+
+// run a machine on each node in a snapshot and call cb for each match in document order
+// only the nodes the machine could start on get visited
+// returns the number of matches
+int snapshot_process_cb( struct machine *m, struct snapshot *s, snap_callback cb, void *user )
+{
+	struct context *ctx;
+	struct snap_node *node;
+	int i, n, ret, count = 0;
+
+	ctx = machine_context( m );
+	bind_tags( ctx, m, snap_tag, s );
+	start_tags( ctx, m, s->ntags, snap_tag, s );
+	ctx->snap = s;
+	for( i = 0; i < s->n; )
+	{
+		node = &s->node[i];
+		if( !ctx->start[node->name + 1] )
+		{
+			i++;
+			continue;
+		}
+		ret = snap_node_process( m, node, ctx );
+		if( ctx->status != 0 )
+			break;
+		if( ret )
+		{
+			n = find_matches( m, ctx );
+			count++;
+			ret = cb( s, i, n > 0 ? ctx->re : NULL, n, user );
+			if( ret == TREEXPR_STOP )
+				break;
+			if( ret == TREEXPR_SKIP )
+			{
+				i = node->end;
+				continue;
+			}
+		}
+		i++;
+	}
+	ctx->snap = NULL;
+	return ctx->status != 0 ? ctx->status : count;
+}
+
+// copies a match into a list (in reverse document order)
+int snap_list_callback( struct snapshot *s, int node, struct regex_match *re, int nre, void *user )
+{
+	struct match **z = user;
+
+	list_callback( s->src != NULL ? s->src[node] : NULL, re, nre, user );
+	( *z )->num = node;
+	return TREEXPR_CONTINUE;
+}
+
+// run a machine on each node in a snapshot and return a list of matches, like document_process
+// each match's node is the one the snapshot's node was copied from, and num it's number
+// the matched strings are in the snapshot
+struct match *snapshot_process( struct machine *m, struct snapshot *s )
+{
+	struct match *z = NULL;
+
+	snapshot_process_cb( m, s, snap_list_callback, &z );
+	return z;
+}
+
+/*
+ * JSON documents
+ *
+ * A JSON document is parsed in place: the values go in one array in document order and their
+ * strings are left in the caller's buffer, so nothing is allocated for each value and nothing is
+ * copied. Each member of an object is a node named after it's key, and each element of an array
+ * is a node without a name (only "." matches it). Scalars are the contents of their node (null
+ * has none), objects and arrays have their members and elements as children, and an object's
+ * scalar members are also it's attributes. Strings are matched the way they're written in the
+ * buffer, escapes and all.
+ */
+
+// finds the slot in the hash table for a key, or the empty slot it would go in
+unsigned int json_slot( struct json_doc *j, const char *name, size_t len )
+{
+	unsigned int h = 2166136261u, i;
+	struct json_key *k;
+	size_t n;
+
+	for( n = 0; n < len; n++ )
+		h = SNAP_HASH_FOLD( h, name[n] );
+	for( i = h & ( j->hsize - 1 ); j->hash[i] != 0; i = ( i + 1 ) & ( j->hsize - 1 ))
+	{
+		k = &j->tag[j->hash[i] - 1];
+		if( k->len == len && strncasecmp( k->name, name, len ) == 0 )
+			break;
+	}
+	return i;
+}
+
+// returns the tag for a name, or SNAP_NONE if no key is called that
+int json_tag( struct json_doc *j, const char *name )
+{
+	unsigned int i;
+
+	if( j->hsize == 0 )
+		return SNAP_NONE;
+	i = json_slot( j, name, strlen( name ));
+	return j->hash[i] != 0 ? j->hash[i] - 1 : SNAP_NONE;
+}
+
+// json_tag() for bind_tags() and start_tags()
+int json_key_tag( void *tree, const char *name )
+{
+	return json_tag( tree, name );
+}
+
+// returns the tag for a key, adding it if it's new
+int json_intern( struct json_doc *j, const char *name, size_t len )
+{
+	unsigned int i, size;
+	int *old, k;
+
+	// keep the table at most half full
+	if(( j->ntags + 1 ) * 2 > j->hsize )
+	{
+		old = j->hash;
+		size = j->hsize;
+		j->hsize = size ? size * 2 : 64;
+		j->hash = zalloc( j->hsize * sizeof( *j->hash ));
+		for( k = 0; k < j->ntags; k++ )
+			j->hash[json_slot( j, j->tag[k].name, j->tag[k].len )] = k + 1;
+		free( old );
+	}
+	i = json_slot( j, name, len );
+	if( j->hash[i] == 0 )
+	{
+		if( j->ntags >= j->tagsize )
+		{
+			j->tagsize = j->tagsize ? j->tagsize * 2 : 64;
+			j->tag = realloc( j->tag, j->tagsize * sizeof( *j->tag ));
+		}
+		j->tag[j->ntags].name = name;
+		j->tag[j->ntags].len = len;
+		j->hash[i] = ++j->ntags;
+	}
+	return j->hash[i] - 1;
+}
+
+// adds a value with a name (or -1) and no children, returns it's number
+int json_value( struct json_doc *j, int name )
+{
+	struct json_node *n;
+
+	if( j->n >= j->nsize )
+	{
+		j->nsize = j->nsize ? j->nsize * 2 : 256;
+		j->node = realloc( j->node, j->nsize * sizeof( *j->node ));
+	}
+	n = &j->node[j->n];
+	n->name = name;
+	n->type = JSON_NULL;
+	n->child = n->next = -1;
+	n->end = j->n + 1;
+	n->text = NULL;
+	n->len = 0;
+	return j->n++;
+}
+
+// skips white space
+const char *json_space( const char *p, const char *e )
+{
+	while( p < e && ( *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' ))
+		p++;
+	return p;
+}
+
+// finds the quote at the end of a string that starts at p, NULL if there isn't one
+const char *json_string( const char *p, const char *e )
+{
+	for( ; p < e && *p != '"'; p++ )
+		if( *p == '\\' && ++p == e )
+			return NULL;
+	return p < e ? p : NULL;
+}
+
+// can a value end right before p? (at the end of the input, white space, a comma or a bracket)
+int json_delim( const char *p, const char *e )
+{
+	return p == e || ( *p != '\0' && strchr( " \t\n\r,]}", *p ) != NULL );
+}
+
+// skips the digits at p
+const char *json_digits( const char *p, const char *e )
+{
+	while( p < e && isdigit( (unsigned char)*p ))
+		p++;
+	return p;
+}
+
+// finds the end of the number at p, NULL if it isn't one
+// that's an optional minus, an integer without leading zeros, then an optional fraction and an
+// optional exponent
+const char *json_number( const char *p, const char *e )
+{
+	const char *q;
+
+	if( p < e && *p == '-' )
+		p++;
+	if( p < e && *p == '0' )
+		p++;
+	else if(( q = json_digits( p, e )) > p )
+		p = q;
+	else
+		return NULL;
+	if( p < e && *p == '.' )
+	{
+		if(( q = json_digits( p + 1, e )) == p + 1 )
+			return NULL;
+		p = q;
+	}
+	if( p < e && ( *p == 'e' || *p == 'E' ))
+	{
+		p++;
+		if( p < e && ( *p == '+' || *p == '-' ))
+			p++;
+		if(( q = json_digits( p, e )) == p )
+			return NULL;
+		p = q;
+	}
+	return p;
+}
+
+// reads the scalar at p into value n, returns where it ends or NULL if it isn't one
+const char *json_scalar( struct json_node *n, const char *p, const char *e )
+{
+	const char *q;
+
+	if( *p == '"' )
+	{
+		if(( q = json_string( p + 1, e )) == NULL )
+			return NULL;
+		n->type = JSON_STRING;
+		n->text = p + 1;
+		n->len = q - p - 1;
+		return q + 1;
+	}
+	if( e - p >= 4 && strncmp( p, "null", 4 ) == 0 )
+		q = p + 4;
+	else if( e - p >= 4 && strncmp( p, "true", 4 ) == 0 )
+	{
+		n->type = JSON_TRUE;
+		q = p + 4;
+	}
+	else if( e - p >= 5 && strncmp( p, "false", 5 ) == 0 )
+	{
+		n->type = JSON_FALSE;
+		q = p + 5;
+	}
+	else if(( q = json_number( p, e )) != NULL )
+		n->type = JSON_NUMBER;
+	else
+		return NULL;
+	// a scalar has to be followed by something that can come after a value
+	if( !json_delim( q, e ))
+		return NULL;
+	if( n->type != JSON_NULL )
+	{
+		n->text = p;
+		n->len = q - p;
+	}
+	return q;
+}
+
+// parses a JSON document in buf, which has to stay around (and unchanged) until the document is
+// freed with free_json(), returns NULL if it isn't JSON
+struct json_doc *treexpr_json( const char *buf, size_t len )
+{
+	struct json_doc *j = zalloc( sizeof( struct json_doc ));
+	const char *p = buf, *e = buf + len, *q;
+	int *open, *last, sp = 0, nstack = 64, name = -1, i, ok = 1;
+	char close;
+
+	// last[sp] is the last value we added at depth sp, open[sp] is the array or object it's in
+	open = zalloc( nstack * sizeof( *open ));
+	last = zalloc( nstack * sizeof( *last ));
+	last[0] = -1;
+	while( ok )
+	{
+		p = json_space( p, e );
+		if( p == e )
+		{
+			ok = 0;
+			break;
+		}
+		i = json_value( j, name );
+		if( last[sp] >= 0 )
+			j->node[last[sp]].next = i;
+		else if( sp > 0 )
+			j->node[open[sp]].child = i;
+		last[sp] = i;
+
+		if( *p == '{' || *p == '[' )
+		{
+			j->node[i].type = *p++ == '{' ? JSON_OBJECT : JSON_ARRAY;
+			if( sp + 1 >= nstack )
+			{
+				nstack *= 2;
+				open = realloc( open, nstack * sizeof( *open ));
+				last = realloc( last, nstack * sizeof( *last ));
+			}
+			sp++;
+			open[sp] = i;
+			last[sp] = -1;
+		}
+		else if(( p = json_scalar( &j->node[i], p, e )) == NULL )
+		{
+			ok = 0;
+			break;
+		}
+
+		// close the arrays and objects that end here, then look for the next value
+		for( ;; )
+		{
+			p = json_space( p, e );
+			if( sp == 0 )
+				break;
+			close = j->node[open[sp]].type == JSON_OBJECT ? '}' : ']';
+			if( p < e && *p == close )
+			{
+				p++;
+				j->node[open[sp--]].end = j->n;
+				continue;
+			}
+			if( last[sp] >= 0 )
+			{
+				if( p == e || *p != ',' )
+					ok = 0;
+				else
+					p = json_space( p + 1, e );
+			}
+			break;
+		}
+		if( !ok || sp == 0 )
+			break;
+
+		// members of objects start with their key
+		name = -1;
+		if( j->node[open[sp]].type == JSON_OBJECT )
+		{
+			if( p == e || *p != '"' || ( q = json_string( p + 1, e )) == NULL )
+			{
+				ok = 0;
+				break;
+			}
+			name = json_intern( j, p + 1, q - p - 1 );
+			p = json_space( q + 1, e );
+			if( p == e || *p != ':' )
+			{
+				ok = 0;
+				break;
+			}
+			p++;
+		}
+	}
+	free( open );
+	free( last );
+	// there can't be anything after the top value
+	if( !ok || p != e )
+	{
+		free_json( j );
+		return NULL;
+	}
+	return j;
+}
+
+void free_json( struct json_doc *j )
+{
+	if( j == NULL )
+		return;
+	free( j->node );
+	free( j->tag );
+	free( j->hash );
+	free( j );
+}
+
+// returns a value's key and sets len to it's length, NULL if it doesn't have one
+const char *json_name( struct json_doc *j, int node, size_t *len )
+{
+	if( j->node[node].name < 0 )
+		return NULL;
+	*len = j->tag[j->node[node].name].len;
+	return j->tag[j->node[node].name].name;
+}
+
+// returns a value's contents and sets len to their length, NULL if it doesn't have any
+const char *json_content( struct json_doc *j, int node, size_t *len )
+{
+	*len = j->node[node].len;
+	return j->node[node].text;
+}
+
+// finds the scalar member of an object with the same tag as attr
+int json_find_attr( struct context *ctx, struct json_node *node, struct attribute *attr,
+	char **value, size_t *len )
+{
+	struct json_node *cur;
+	int i;
+
+	for( i = node->child; i >= 0; i = cur->next )
+	{
+		cur = &ctx->json->node[i];
+		if( cur->name == ctx->tag[attr->sym] && cur->type < JSON_ARRAY )
+		{
+			*value = (char *)cur->text;
+			*len = cur->len;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// the matcher for JSON documents
+#define PUSH_FRAME			json_push_frame
+#define TREE_PROCESS		json_tree_process
+#define NODE_PROCESS		json_node_process
+#define ATTRS_PROCESS		json_attrs_process
+#define NODE				struct json_node *
+#define NAME_OK( ctx, tr, n )	( ctx->tag[( tr )->sym] == ( n )->name \
+	|| ctx->tag[( tr )->sym] == SNAP_ANY )
+#define CHILDREN( ctx, n )	(( n )->child >= 0 ? ( ctx )->json->node + ( n )->child : NULL )
+#define NEXT( ctx, n )		(( n )->next >= 0 ? ( ctx )->json->node + ( n )->next : NULL )
+#define CONTENT( ctx, n )	((char *)( n )->text )
+#define CONTENT_LEN( ctx, n )	(( n )->len )
+#define FIND_ATTR( ctx, n, attr, v, l )	json_find_attr( ctx, n, attr, v, l )
+
+#include "treewalk.c"
+
+// run a machine on each value in a JSON document and call cb for each match in document order
+// only the values the machine could start on get visited
+// returns the number of matches
+int json_process_cb( struct machine *m, struct json_doc *j, json_callback cb, void *user )
+{
+	struct context *ctx;
+	struct json_node *node;
+	int i, n, ret, count = 0;
+
+	ctx = machine_context( m );
+	bind_tags( ctx, m, json_key_tag, j );
+	start_tags( ctx, m, j->ntags, json_key_tag, j );
+	ctx->json = j;
+	for( i = 0; i < j->n; )
+	{
+		node = &j->node[i];
+		if( !ctx->start[node->name + 1] )
+		{
+			i++;
+			continue;
+		}
+		ret = json_node_process( m, node, ctx );
+		if( ctx->status != 0 )
+			break;
+		if( ret )
+		{
+			n = find_matches( m, ctx );
+			count++;
+			ret = cb( j, i, n > 0 ? ctx->re : NULL, n, user );
+			if( ret == TREEXPR_STOP )
+				break;
+			if( ret == TREEXPR_SKIP )
+			{
+				i = node->end;
+				continue;
+			}
+		}
+		i++;
+	}
+	ctx->json = NULL;
+	return ctx->status != 0 ? ctx->status : count;
+}
+
+// copies a match into a list (in reverse document order)
+int json_list_callback( struct json_doc *j, int node, struct regex_match *re, int nre, void *user )
+{
+	struct match **z = user;
+
+	list_callback( NULL, re, nre, user );
+	( *z )->num = node;
+	return TREEXPR_CONTINUE;
+}
+
+// run a machine on each value in a JSON document and return a list of matches, like
+// document_process, with the number of the value that matched in num (node is NULL)
+// the matched strings point into the document's buffer and aren't NUL terminated
+struct match *json_process( struct machine *m, struct json_doc *j )
+{
+	struct match *z = NULL;
+
+	json_process_cb( m, j, json_list_callback, &z );
+	return z;
+}
+
+/*
+ * Tree adapters
+ *
+ * Other kinds of trees can be matched by handing us a struct tree_adapter that knows how to
+ * get around them. The matcher below goes through the adapter for every step, so it's slower
+ * than the ones for libxml trees and snapshots; a run with treexpr_libxml_adapter doesn't use
+ * it at all and goes straight to the libxml matcher instead.
+ */
+
+// returns the contents of a node in the tree we're running over
+char *adapter_content( struct context *ctx, void *node )
+{
+	size_t len;
+
+	return (char *)ctx->adapter->content( ctx->tree, node, &len );
+}
+
+// returns the length of a node's contents
+size_t adapter_content_len( struct context *ctx, void *node )
+{
+	size_t len;
+
+	return ctx->adapter->content( ctx->tree, node, &len ) != NULL ? len : 0;
+}
+
+// finds the attribute of a node with the same name id as attr
+int adapter_find_attr( struct context *ctx, void *node, struct attribute *attr, char **value,
+	size_t *len )
+{
+	const char *v;
+
+	if( ctx->tag[attr->sym] < 0
+		|| !ctx->adapter->attr( ctx->tree, node, ctx->tag[attr->sym], &v, len ))
+		return 0;
+	*value = (char *)v;
+	return 1;
+}
+
+// the matcher for trees with an adapter
+#define PUSH_FRAME			adapter_push_frame
+#define TREE_PROCESS		adapter_tree_process
+#define NODE_PROCESS		adapter_node_process
+#define ATTRS_PROCESS		adapter_attrs_process
+#define NODE				void *
+#define NAME_OK( ctx, tr, n )	( ctx->tag[( tr )->sym] == SNAP_ANY || ( ctx->tag[( tr )->sym] >= 0 \
+	&& ctx->tag[( tr )->sym] == ( ctx )->adapter->name(( ctx )->tree, n )))
+#define CHILDREN( ctx, n )	(( ctx )->adapter->child(( ctx )->tree, n ))
+#define NEXT( ctx, n )		(( ctx )->adapter->next(( ctx )->tree, n ))
+#define CONTENT( ctx, n )	adapter_content( ctx, n )
+#define CONTENT_LEN( ctx, n )	adapter_content_len( ctx, n )
+#define FIND_ATTR( ctx, n, attr, v, l )	adapter_find_attr( ctx, n, attr, v, l )
+
+#include "treewalk.c"
+
+// runs machine m on node, it's siblings after it and all of their descendants, calling cb for
+// each match in document order, like node_recurse()
+void adapter_recurse( struct machine *m, void *node, tree_callback cb, void *user,
+	struct context *ctx )
+{
+	const struct tree_adapter *ta = ctx->adapter;
+	void *cur = node;
+	int n, ret, base = ctx->sp;
+
+	for( ;; )
+	{
+		// at the end of a list of children go back to the parent's next sibling
+		if( cur == NULL )
+		{
+			if( ctx->sp == base )
+				return;
+			cur = ctx->nodes[--ctx->sp];
+			continue;
+		}
+		ret = adapter_node_process( m, cur, ctx );
+		if( ctx->status != 0 )
+			break;
+		if( ret )
+		{
+			n = find_matches( m, ctx );
+			ret = cb( cur, n > 0 ? ctx->re : NULL, n, user );
+			if( ret == TREEXPR_STOP )
+				break;
+			if( ret == TREEXPR_SKIP )
+			{
+				cur = ta->next( ctx->tree, cur );
+				continue;
+			}
+		}
+		// go down to the children
+		push_node( ctx, ta->next( ctx->tree, cur ));
+		cur = ta->child( ctx->tree, cur );
+	}
+	ctx->sp = base;
+}
+
+// state passed to the callbacks below
+struct adapter_count
+{
+	tree_callback cb;
+	void *user;
+	int n;
+};
+
+// counts matches on their way to the user's callback
+int adapter_count_callback( void *node, struct regex_match *re, int nre, void *user )
+{
+	struct adapter_count *ac = user;
+
+	ac->n++;
+	return ac->cb( node, re, nre, ac->user );
+}
+
+// same as above, for the libxml matcher
+int adapter_xml_callback( xmlNodePtr node, struct regex_match *re, int nre, void *user )
+{
+	return adapter_count_callback( node, re, nre, user );
+}
+
+// run a machine on root, it's siblings after it and all of their descendants in a tree with an
+// adapter, and call cb for each match in document order
+// returns the number of matches
+int adapter_process_cb( struct machine *m, const struct tree_adapter *ta, void *tree, void *root,
+	tree_callback cb, void *user )
+{
+	struct adapter_count ac;
+	struct context *ctx;
+
+	ac.cb = cb;
+	ac.user = user;
+	ac.n = 0;
+	ctx = machine_context( m );
+	if( ta == &treexpr_libxml_adapter )
+		node_recurse( m, root, NULL, adapter_xml_callback, &ac, ctx );
+	else
+	{
+		bind_tags( ctx, m, ta->tag, tree );
+		ctx->adapter = ta;
+		ctx->tree = tree;
+		adapter_recurse( m, root, adapter_count_callback, &ac, ctx );
+		ctx->adapter = NULL;
+		ctx->tree = NULL;
+	}
+	return ctx->status != 0 ? ctx->status : ac.n;
+}
+
+// the libxml adapter, for running over libxml trees like any other kind
+int xml_adapter_name( void *tree, void *node )
+{
+	xmlNodePtr n = node;
+
+	return n->name != NULL ? snapshot_tag( tree, (char *)n->name ) : -1;
+}
+
+void *xml_adapter_child( void *tree, void *node )
+{
+	return ((xmlNodePtr)node )->children;
+}
+
+void *xml_adapter_next( void *tree, void *node )
+{
+	return ((xmlNodePtr)node )->next;
+}
+
+const char *xml_adapter_content( void *tree, void *node, size_t *len )
+{
+	xmlNodePtr n = node;
+
+	if( n->content == NULL )
+		return NULL;
+	*len = strlen( (char *)n->content );
+	return (char *)n->content;
+}
+
+int xml_adapter_attr( void *tree, void *node, int name, const char **value, size_t *len )
+{
+	struct snapshot *s = tree;
+	struct _xmlAttr *cur;
+
+	for( cur = ((xmlNodePtr)node )->properties; cur != NULL; cur = cur->next )
+		if( strcasecmp( s->text + s->tag[name], (char *)cur->name ) == 0 )
+		{
+			*value = cur->children != NULL ? (char *)cur->children->content : NULL;
+			*len = *value != NULL ? strlen( *value ) : 0;
+			return 1;
+		}
+	return 0;
+}
+
+const struct tree_adapter treexpr_libxml_adapter = {
+	snap_tag,
+	xml_adapter_name,
+	xml_adapter_child,
+	xml_adapter_next,
+	xml_adapter_content,
+	xml_adapter_attr
+};
+
+// makes the tree to use with treexpr_libxml_adapter, a snapshot of just the names of the
+// document's nodes and attributes (free it with free_snapshot())
+struct snapshot *treexpr_libxml_names( xmlDocPtr doc )
+{
+	struct snapshot *s = zalloc( sizeof( struct snapshot ));
+	struct _xmlAttr *attr;
+	xmlNodePtr cur, *stack = NULL;
+	int sp = 0, nstack = 0;
+
+	cur = doc->children;
+	for( ;; )
+	{
+		if( cur == NULL )
+		{
+			if( sp == 0 )
+				break;
+			cur = stack[--sp];
+			continue;
+		}
+		if( cur->name != NULL )
+			snap_intern( s, (char *)cur->name, strlen( (char *)cur->name ));
+		if( cur->type == XML_ELEMENT_NODE )
+			for( attr = cur->properties; attr != NULL; attr = attr->next )
+				snap_intern( s, (char *)attr->name, strlen( (char *)attr->name ));
+		if( sp >= nstack )
+		{
+			nstack = nstack ? nstack * 2 : 64;
+			stack = realloc( stack, nstack * sizeof( *stack ));
+		}
+		stack[sp++] = cur->next;
+		cur = cur->children;
+	}
+	free( stack );
+	return s;
+}
+
+/*
+ * Prefilter
+ *
+ * Most regex restrictions can't match unless the text contains some literal string (the "must"
+ * string of the regex) and that text comes straight out of the raw document. If a restriction
+ * has to be satisfied for the expression to match at all, then a document that doesn't contain
+ * its literal can be thrown away before we bother parsing it.
+ *
+ * We assume the raw document is in an ASCII compatible encoding and doesn't spell out plain
+ * ASCII characters with character references. Literals are cut at characters that might be
+ * escaped or reformatted in the markup (&, <, >, quotes, whitespace and non-ASCII bytes).
+ */
+
+// returns true iff every path from start to final takes the transition out of state t
+int mandatory( struct machine *m, struct state *t, char *seen, struct state **stack )
+{
+	struct state *s;
+	struct epsilon *ep;
+	int n = 0;
+
+	memset( seen, 0, m->states );
+	stack[n++] = m->start;
+	seen[m->start->num] = 1;
+	while( n > 0 )
+	{
+		s = stack[--n];
+		if( s == m->final )
+			return 0;
+		for( ep = s->ep; ep != NULL; ep = ep->next )
+			if( !seen[ep->st->num] )
+			{
+				seen[ep->st->num] = 1;
+				stack[n++] = ep->st;
+			}
+		if( s->tr != NULL && s != t && !seen[s->tr->st->num] )
+		{
+			seen[s->tr->st->num] = 1;
+			stack[n++] = s->tr->st;
+		}
+	}
+	return 1;
+}
+
+// can this character be written differently in the raw document?
+#define UNSAFE( c )		((c) == '&' || (c) == '<' || (c) == '>' || (c) == '"' \
+						|| (c) == '\'' || isspace( c ) || ((c) & 0x80 ))
+
+// adds the longest safe piece of a literal to a list
+void add_literal( char ***lits, int *n, const char *str, size_t len )
+{
+	size_t i, j, best = 0, bestlen = 0;
+	char *lit;
+	int k;
+
+	for( i = 0; i < len; i = j + 1 )
+	{
+		for( j = i; j < len && !UNSAFE( (unsigned char)str[j] ); j++ );
+		if( j - i > bestlen )
+		{
+			best = i;
+			bestlen = j - i;
+		}
+	}
+	if( bestlen == 0 )
+		return;
+	lit = zalloc( bestlen + 1 );
+	for( i = 0; i < bestlen; i++ )
+		lit[i] = tolower( (unsigned char)str[best + i] );
+
+	// skip duplicates
+	for( k = 0; k < *n; k++ )
+		if( strcmp(( *lits )[k], lit ) == 0 )
+		{
+			free( lit );
+			return;
+		}
+	*lits = realloc( *lits, ( *n + 2 ) * sizeof( **lits ));
+	( *lits )[( *n )++] = lit;
+	( *lits )[*n] = NULL;
+}
+
+// adds the must string of a regex to a list
+void add_regmust( char ***lits, int *n, regex_t *re )
+{
+	char buf[256];
+	size_t len;
+
+	len = notbuiltin_regmust( re, buf, sizeof( buf ));
+	if( len >= sizeof( buf ))
+		len = sizeof( buf ) - 1;
+	add_literal( lits, n, buf, len );
+}
+
+// collects the literals of the restrictions a machine can't match without
+void find_literals( struct machine *m, char ***lits, int *n )
+{
+	struct state *cur, **stack;
+	struct attribute *attr;
+	struct trans *tr;
+	char *seen;
+
+	if( m->E == NULL )
+		build_e( m );
+	seen = zalloc( m->states );
+	stack = zalloc( m->states * sizeof( *stack ));
+	for( cur = m->start; cur != NULL; cur = cur->next )
+	{
+		tr = cur->tr;
+		if( tr == NULL || !mandatory( m, cur, seen, stack ))
+			continue;
+		if( tr->re.re_magic != 0 )
+			add_regmust( lits, n, &tr->re );
+		for( attr = tr->attrs; attr != NULL; attr = attr->next )
+		{
+			add_literal( lits, n, attr->name, strlen( attr->name ));
+			if( attr->re.re_magic != 0 )
+				add_regmust( lits, n, &attr->re );
+		}
+		if( tr->ptr != NULL )
+			find_literals( tr->ptr, lits, n );
+	}
+	free( seen );
+	free( stack );
+}
+
+// sort literals longest first, they're the least likely to show up by chance
+int literal_cmp( const void *a, const void *b )
+{
+	return strlen( *(char * const *)b ) - strlen( *(char * const *)a );
+}
+
+// case insensitive search for a lower case needle in a haystack
+const char *memcasemem( const char *hay, size_t hlen, const char *needle, size_t nlen )
+{
+	const char *end = hay + hlen, *lo, *up, *p;
+	int c = (unsigned char)needle[0];
+	size_t i;
+
+	if( nlen > hlen )
+		return NULL;
+	end -= nlen - 1;
+
+	// let memchr find candidates for the first character in both cases
+	lo = memchr( hay, c, end - hay );
+	up = toupper( c ) != c ? memchr( hay, toupper( c ), end - hay ) : NULL;
+	while( lo != NULL || up != NULL )
+	{
+		if( up == NULL || ( lo != NULL && lo < up ))
+		{
+			p = lo;
+			lo = memchr( p + 1, c, end - p - 1 );
+		}
+		else
+		{
+			p = up;
+			up = memchr( p + 1, toupper( c ), end - p - 1 );
+		}
+		for( i = 1; i < nlen && tolower( (unsigned char)p[i] ) == needle[i]; i++ );
+		if( i == nlen )
+			return p;
+	}
+	return NULL;
+}
+
+// returns the literals a document must contain for a machine to match
+char **machine_literals( struct machine *m )
+{
+	int n = 0;
+
+	if( m->lits == NULL )
+	{
+		find_literals( m, &m->lits, &n );
+		if( m->lits == NULL )
+			m->lits = zalloc( sizeof( *m->lits ));
+		qsort( m->lits, n, sizeof( *m->lits ), literal_cmp );
+	}
+	return m->lits;
+}
+
+// we can't say anything about UTF-16 and UTF-32 documents
+#define UNFILTERABLE( buf, len )	((len) >= 2 && (((buf)[0] == '\xff' && (buf)[1] == '\xfe') \
+									|| ((buf)[0] == '\xfe' && (buf)[1] == '\xff') || (buf)[0] == 0 ))
+
+// quickly checks whether a raw document could possibly match, before it is parsed
+// returns false if the document can't match, true if it might
+int document_prefilter( struct machine *m, const char *buf, size_t len )
+{
+	char **lits = machine_literals( m );
+	int i;
+
+	if( UNFILTERABLE( buf, len ))
+		return 1;
+	for( i = 0; lits[i] != NULL; i++ )
+		if( memcasemem( buf, len, lits[i], strlen( lits[i] )) == NULL )
+			return 0;
+	return 1;
+}
+
+/*
+ * Pattern set prefilter
+ *
+ * With thousands of patterns, searching for each literal on it's own is too slow. Instead we
+ * build one Aho-Corasick automaton out of the literals of every pattern in a set, so a single
+ * scan over the raw document tells us which literals it contains, and therefore which patterns
+ * can possibly match.
+ */
+
+// adds a state with no transitions to the automaton, returns it's number
+int new_ac_state( struct literal_set *ls, int *size )
+{
+	int c;
+
+	if( ls->states >= *size )
+	{
+		*size = *size ? *size * 2 : 64;
+		ls->delta = realloc( ls->delta, *size * ls->classes * sizeof( *ls->delta ));
+		ls->lit = realloc( ls->lit, *size * sizeof( *ls->lit ));
+		ls->dict = realloc( ls->dict, *size * sizeof( *ls->dict ));
+	}
+	for( c = 0; c < ls->classes; c++ )
+		ls->delta[ls->states * ls->classes + c] = -1;
+	ls->lit[ls->states] = ls->dict[ls->states] = -1;
+	return ls->states++;
+}
+
+// builds the automaton over the literals of every pattern in a set
+struct literal_set *build_literal_set( struct pattern_set *ps )
+{
+	struct literal_set *ls;
+	char **lits, **all = NULL;
+	int i, j, k, c, st, nall = 0, size = 0, *queue, head, tail;
+	const unsigned char *p;
+
+	ls = zalloc( sizeof( struct literal_set ));
+	ls->pstart = zalloc(( ps->n + 1 ) * sizeof( *ls->pstart ));
+
+	// number the distinct literals and remember which ones each pattern needs
+	for( i = 0; i < ps->n; i++ )
+	{
+		ls->pstart[i] = ls->npl;
+		lits = machine_literals( ps->m[i] );
+		for( j = 0; lits[j] != NULL; j++ )
+		{
+			for( k = 0; k < nall && strcmp( all[k], lits[j] ) != 0; k++ );
+			if( k == nall )
+			{
+				all = realloc( all, ( nall + 1 ) * sizeof( *all ));
+				all[nall++] = lits[j];
+			}
+			ls->pl = realloc( ls->pl, ( ls->npl + 1 ) * sizeof( *ls->pl ));
+			ls->pl[ls->npl++] = k;
+		}
+	}
+	ls->pstart[ps->n] = ls->npl;
+	ls->nlits = nall;
+	ls->found = zalloc( nall + 1 );
+
+	// every byte that shows up in a literal gets a class of it's own (both cases), the
+	// rest share class 0
+	ls->classes = 1;
+	for( i = 0; i < nall; i++ )
+		for( p = (const unsigned char *)all[i]; *p != 0; p++ )
+			if( ls->cls[*p] == 0 )
+			{
+				ls->cls[*p] = ls->classes;
+				ls->cls[toupper( *p )] = ls->classes;
+				ls->classes++;
+			}
+
+	// build the trie, -1 means no transition yet
+	new_ac_state( ls, &size );
+	for( i = 0; i < nall; i++ )
+	{
+		st = 0;
+		for( p = (const unsigned char *)all[i]; *p != 0; p++ )
+		{
+			c = ls->cls[*p];
+			if( ls->delta[st * ls->classes + c] == -1 )
+				ls->delta[st * ls->classes + c] = new_ac_state( ls, &size );
+			st = ls->delta[st * ls->classes + c];
+		}
+		ls->lit[st] = i;
+	}
+
+	// breadth first, fill in the missing transitions from the failure state and find the
+	// nearest failure state that recognises a literal
+	queue = zalloc( ls->states * sizeof( *queue ));
+	ls->fail = zalloc( ls->states * sizeof( *ls->fail ));
+	head = tail = 0;
+	for( c = 0; c < ls->classes; c++ )
+	{
+		st = ls->delta[c];
+		if( st == -1 )
+			ls->delta[c] = 0;
+		else
+			queue[tail++] = st;
+	}
+	while( head < tail )
+	{
+		i = queue[head++];
+		for( c = 0; c < ls->classes; c++ )
+		{
+			st = ls->delta[i * ls->classes + c];
+			j = ls->delta[ls->fail[i] * ls->classes + c];
+			if( st == -1 )
+			{
+				ls->delta[i * ls->classes + c] = j;
+				continue;
+			}
+			ls->fail[st] = j;
+			ls->dict[st] = ls->lit[j] != -1 ? j : ls->dict[j];
+			queue[tail++] = st;
+		}
+	}
+	free( queue );
+	ls->stamp = zalloc( ls->states * sizeof( *ls->stamp ));
+	free( all );
+	return ls;
+}
+
+void free_literal_set( struct literal_set *ls )
+{
+	if( ls == NULL )
+		return;
+	free( ls->delta );
+	free( ls->lit );
+	free( ls->dict );
+	free( ls->fail );
+	free( ls->stamp );
+	free( ls->found );
+	free( ls->pstart );
+	free( ls->pl );
+	free( ls );
+}
+
+// scans a raw document once and sets cand[i] for each pattern i that could possibly match it
+// returns the number of candidates
+int pattern_set_prefilter( struct pattern_set *ps, const char *buf, size_t len, char *cand )
+{
+	struct literal_set *ls;
+	const unsigned char *p, *end = (const unsigned char *)buf + len;
+	int i, j, st, n = 0;
+
+	if( ps->ls == NULL )
+		ps->ls = build_literal_set( ps );
+	ls = ps->ls;
+
+	if( UNFILTERABLE( buf, len ))
+	{
+		memset( cand, 1, ps->n );
+		return ps->n;
+	}
+
+	// run the automaton, each state only needs to report it's literals once per scan
+	memset( ls->found, 0, ls->nlits );
+	if( ++ls->gen == 0 )
+	{
+		memset( ls->stamp, 0, ls->states * sizeof( *ls->stamp ));
+		ls->gen = 1;
+	}
+	st = 0;
+	for( p = (const unsigned char *)buf; p < end; p++ )
+	{
+		st = ls->delta[st * ls->classes + ls->cls[*p]];
+		for( i = st; i > 0 && ls->stamp[i] != ls->gen; i = ls->dict[i] )
+		{
+			ls->stamp[i] = ls->gen;
+			if( ls->lit[i] != -1 )
+				ls->found[ls->lit[i]] = 1;
+		}
+	}
+
+	// a pattern can only match if all of it's literals are there
+	for( i = 0; i < ps->n; i++ )
+	{
+		for( j = ls->pstart[i]; j < ls->pstart[i + 1] && ls->found[ls->pl[j]]; j++ );
+		cand[i] = j == ls->pstart[i + 1];
+		n += cand[i];
+	}
+	return n;
+}
@@ -36,14 +36,17 @@ struct epsilon
 };
 
 #define RESUBR	( 10 )
+#define NOLEN	( (size_t)-1 ) // length we haven't worked out yet
 
 struct attribute
 {
 	struct attribute *next;
 	char *name; // name of attribute to match
 	regex_t re; // compiled regular expression to match
-	regmatch_t match[RESUBR]; // matches
-	char *str; // string containing matches
+	char *pat; // source of the regular expression
+	const regex_t *key; // the first regex with the same source, keys the result cache
+	int slot; // where a run keeps the matches, see struct capture
+	int sym; // number of the name among the machine's symbols
 };
 
 struct trans
@@ -52,8 +55,10 @@ struct trans
 	// stuff to match
 	char *name;			// name of tag to match against
 	regex_t re;			// compiled regular expression to match against contents
-	regmatch_t match[RESUBR]; // matches
-	char *str;			// string containing matches
+	char *pat;			// source of the regular expression
+	const regex_t *key;	// the first regex with the same source, keys the result cache
+	int slot;			// where a run keeps the matches, see struct capture
+	int sym;			// number of the name among the machine's symbols
 	struct attribute *attrs; // attributes to match against
 	struct machine *ptr; // machine to match children
 };
@@ -76,10 +81,78 @@ struct machine
 	// execution
 	int states; // number of states
 	int **E; // arrays of bit masks for E function
-	// I moved these here to make repeated execution a little faster
-	// we alloc these buffers on the first execution and then reuse them
-	int *cur_state; 
-	int *next_state;
+	// worked out before the first run, after that a run never writes to the machine
+	int ready; // have we built E and numbered the slots (here and in nested machines)
+	int slots; // regexes here and in nested machines, each gets a slot in a run's captures
+	int words; // ints of state bitmask a run needs, counting nested machines
+	int syms; // names of transitions and attributes here and in nested machines
+	struct context *ctx; // context for runs that don't bring their own
+	struct context **pctx; // contexts for the threads of parallel runs
+	int npctx;
+	int interned; // have we worked out the regex cache keys yet
+	char **lits; // NULL terminated list of literals a matching document contains
+};
+
+/* Execution contexts */
+
+// outcome of running a regex on a string, cached for the rest of the document
+struct cached_regex
+{
+	const regex_t *re; // regex (cache key)
+	const char *str; // string it ran on (a node's content or an attribute's value)
+	size_t len; // it's length when running through a tree adapter, NOLEN otherwise (cache key)
+	unsigned int gen; // the entry is empty unless this is the context's generation
+	int ok; // did it match
+	regmatch_t match[RESUBR]; // matches
+};
+
+// matches of one regex while a machine runs on a node
+struct capture
+{
+	regmatch_t match[RESUBR]; // matches
+	char *str; // string containing matches, NULL unless the regex matched
+};
+
+// a machine running over a list of siblings, see tree_process()
+struct frame
+{
+	struct machine *m;
+	void *node, *end; // node we're on and where the list stops (whatever kind of tree it is)
+	int *cur_state, *next_state; // bitmasks, n ints each
+	unsigned int n;
+	struct state *st; // state whose transition we're trying, NULL between nodes
+	size_t len; // length of node->content, once a regex needs it
+};
+
+// everything a run over a document needs besides the machine
+// a machine can run in any number of contexts at once
+struct context
+{
+	regscratch_t *scratch; // working space for the regex matcher
+	struct cached_regex *cache; // open addressed hash table of regex results
+	unsigned int size, used; // slots in the table and slots in use this generation
+	unsigned int gen; // bumped for each document, which empties the cache
+	long steps, msec; // budget for each document, 0 for no limit
+	int status; // TREEXPR_EBUDGET once this document's budget is spent
+	struct capture *cap; // captures of the machine being run, by slot
+	int ncap;
+	struct regex_match *re; // buffer of regex matches handed to callbacks
+	int nre;
+	int *bits; // stack of state bitmasks for the machine being run and the ones nested in it
+	int nbits, top;
+	struct frame *frames; // stack of the machine being run and the ones nested in it
+	int nframes, depth;
+	void **nodes; // stack of nodes to carry on with once we're done with the children
+	int nnodes, sp;
+	struct doc_index *index; // index of the document, if we're running over one
+	struct snapshot *snap; // snapshot we're running over
+	int *tag; // it's tag for each of the machine's symbols
+	int ntag;
+	char *start; // tags the machine can start on, by tag + 1
+	int nstart;
+	const struct tree_adapter *adapter; // adapter for the tree we're running over
+	void *tree;
+	struct json_doc *json; // JSON document we're running over
 };
 
 /* Matches */
@@ -96,13 +169,272 @@ struct match
 	struct match *next;
 	xmlNodePtr node; // root node of tree match
 	struct regex_match *re; // list of regular expression matches
+	int id; // id of the pattern that matched (pattern sets only)
+	int num; // number of the node that matched (snapshots only)
+};
+
+/* Pattern sets */
+
+struct first
+{
+	char *name; // symbol that a pattern's root node must match
+	int pat; // index of the pattern
+};
+
+// Aho-Corasick automaton over the literals of every pattern in a set
+struct literal_set
+{
+	unsigned char cls[256]; // class of each byte, case folded
+	int classes; // number of byte classes
+	int states; // number of states
+	int *delta; // transitions [states][classes]
+	int *fail; // failure state of each state
+	int *lit; // literal recognised in each state or -1
+	int *dict; // nearest failure state that recognises a literal or -1
+	unsigned int *stamp, gen; // last scan each state reported it's literals
+	int nlits; // number of distinct literals
+	char *found; // literals found by the current scan
+	int *pstart, *pl, npl; // pattern i needs literals pl[pstart[i]] .. pl[pstart[i + 1] - 1]
+};
+
+struct pattern_set
+{
+	int n, size; // number of patterns and size of the arrays
+	struct machine **m; // compiled expressions
+	int *id; // pattern ids
+	// patterns indexed by the symbols their root node must match, built on first use
+	struct first *first; // sorted by name
+	int nfirst;
+	int *any; // patterns that start with "." and must be tried on every node
+	int nany;
+	int *cand; // buffer of candidate patterns for a node
+	const char *mask; // patterns to run, NULL for all of them
+	struct literal_set *ls; // prefilter, built on first use
+	struct context *ctx; // context for runs over documents
+};
+
+/* Document index */
+
+// a node, or a string belonging to a node, in a document index
+struct index_slot
+{
+	const void *key; // the node, or it's content or one of it's attribute values
+	int pre; // preorder number of the node
+	size_t len; // length of the string
+};
+
+// a node in the list of nodes by name
+struct index_tag
+{
+	const char *name;
+	int pre;
+};
+
+// a document numbered and sorted out once, for running lots of machines over it
+struct doc_index
+{
+	int n; // number of nodes
+	xmlNodePtr *node; // nodes in document order, by preorder number
+	int *post; // postorder number of each node, by preorder number
+	struct index_tag *tag; // nodes with names, sorted by name then document order
+	int ntags;
+	struct index_slot *slot; // open addressed hash table of nodes and their strings
+	unsigned int size;
+	int *cand; // buffer of candidate roots
 };
 
+/* Snapshots */
+
+#define SNAP_ANY	( -2 ) // tag of "."
+#define SNAP_NONE	( -3 ) // tag of a name that isn't in the snapshot
+
+// a node in a snapshot, nodes are numbered in document order
+struct snap_node
+{
+	int name; // tag, -1 for none
+	int child, next; // first child and next sibling, -1 for none
+	int end; // number of the first node after this one's descendants
+	int text, len; // contents start at text in the snapshot's text, -1 for none
+	int attr; // first attribute, -1 for none
+};
+
+struct snap_attr
+{
+	int name; // tag
+	int text, len; // value, text is -1 for none
+	int more; // is the next attribute the same node's
+};
+
+// a read only copy of a document, laid out for matching
+struct snapshot
+{
+	struct snap_node *node;
+	int n, nsize;
+	struct snap_attr *attr;
+	int nattrs, asize;
+	char *text; // names, contents and attribute values, each one NUL terminated
+	int ntext, tsize;
+	int *tag; // where each tag's name starts in text, tag names are unique ignoring case
+	int ntags, tagsize;
+	int *hash; // open addressed hash table of tag + 1, 0 for empty
+	unsigned int hsize;
+	xmlNodePtr *src; // node each one was copied from
+};
+
+/* JSON documents */
+
+#define JSON_NULL		( 0 )
+#define JSON_FALSE		( 1 )
+#define JSON_TRUE		( 2 )
+#define JSON_NUMBER		( 3 )
+#define JSON_STRING		( 4 )
+#define JSON_ARRAY		( 5 )
+#define JSON_OBJECT		( 6 )
+
+// a value in a JSON document, values are numbered in document order
+struct json_node
+{
+	int name; // tag of it's key, -1 for array elements and the top value
+	int type;
+	int child, next; // first member or element and next sibling, -1 for none
+	int end; // number of the first value after this one's descendants
+	const char *text; // scalars (strings without their quotes) in the buffer, NULL for none
+	size_t len;
+};
+
+// a key in a JSON document, as it's written in the buffer
+struct json_key
+{
+	const char *name;
+	size_t len;
+};
+
+// a JSON document parsed in place, it points into the buffer it was parsed from
+struct json_doc
+{
+	struct json_node *node;
+	int n, nsize;
+	struct json_key *tag; // keys, tags are unique ignoring case
+	int ntags, tagsize;
+	int *hash; // open addressed hash table of tag + 1, 0 for empty
+	unsigned int hsize;
+};
+
+/* Tree adapters */
+
+// how to get around some other kind of tree, so machines can run over it
+// names are given ids once per run: tag() returns the id of a name (names are the same if they
+// only differ in case) or a negative number if nothing in the tree has that name, and name()
+// returns the id of a node's name, negative if it doesn't have one
+struct tree_adapter
+{
+	int (*tag)( void *tree, const char *name );
+	int (*name)( void *tree, void *node );
+	void *(*child)( void *tree, void *node ); // first child, NULL for none
+	void *(*next)( void *tree, void *node ); // next sibling, NULL for none
+	// returns the contents of a node and sets len to their length, NULL if it doesn't have any
+	// the contents don't need to be NUL terminated and can share a start with other contents,
+	// but they have to stay put and unchanged until adapter_process_cb() returns, since the
+	// regex matches handed to the callback point into them
+	const char *(*content)( void *tree, void *node, size_t *len );
+	// finds the node's attribute whose name has the id name, false if it hasn't got one
+	// sets value and len like content() does, value is NULL if the attribute has no value
+	int (*attr)( void *tree, void *node, int name, const char **value, size_t *len );
+};
+
+// adapter for libxml trees, it's tree is a treexpr_libxml_names() of the document
+extern const struct tree_adapter treexpr_libxml_adapter;
+
+/* Callbacks */
+
+#define TREEXPR_CONTINUE	( 0 ) // keep searching
+#define TREEXPR_STOP		( 1 ) // stop searching
+#define TREEXPR_SKIP		( 2 ) // keep searching, but not below the matched node
+
+// returned in place of a result when a run goes over its budget, see machine_budget()
+#define TREEXPR_EBUDGET		( -1 )
+
+// returned when a file couldn't be read or parsed, see treexpr_records()
+#define TREEXPR_EREAD		( -2 )
+
+// called for each match, re is an array of nre regex matches (also linked through re->next)
+// the array belongs to the run and is only good until the callback returns
+typedef int (*match_callback)( xmlNodePtr node, struct regex_match *re, int nre, void *user );
+
+// same as above, but also tells you which pattern in a set matched
+typedef int (*set_callback)( int id, xmlNodePtr node, struct regex_match *re, int nre,
+	void *user );
+
+// called for each match in a snapshot, node is the number of the node that matched
+typedef int (*snap_callback)( struct snapshot *s, int node, struct regex_match *re, int nre,
+	void *user );
+
+// called for each match while streaming, with the name and depth (0 at the top) of the node
+// that matched instead of the node itself
+typedef int (*stream_callback)( const char *name, int depth, struct regex_match *re, int nre,
+	void *user );
+
+// called for each match in a JSON document, node is the number of the value that matched
+typedef int (*json_callback)( struct json_doc *j, int node, struct regex_match *re, int nre,
+	void *user );
+
+// called for each match in a tree with an adapter
+typedef int (*tree_callback)( void *node, struct regex_match *re, int nre, void *user );
+
+struct stream;
+
 /* Public functions */
 
 const char *parse_treexpr( const char *expr, struct machine **m );
 void free_machine( struct machine *m );
 struct match *document_process( struct machine *m, xmlDocPtr doc );
 void free_matches( struct match *z );
+int document_process_cb( struct machine *m, xmlDocPtr doc, match_callback cb, void *user );
+struct match *document_process_n( struct machine *m, xmlDocPtr doc, int max );
+int document_match( struct machine *m, xmlDocPtr doc );
+struct pattern_set *new_pattern_set( void );
+void pattern_set_add( struct pattern_set *ps, int id, struct machine *m );
+void free_pattern_set( struct pattern_set *ps );
+int pattern_set_process_cb( struct pattern_set *ps, xmlDocPtr doc, set_callback cb, void *user );
+struct match *pattern_set_process( struct pattern_set *ps, xmlDocPtr doc );
+int document_prefilter( struct machine *m, const char *buf, size_t len );
+int pattern_set_prefilter( struct pattern_set *ps, const char *buf, size_t len, char *cand );
+int pattern_set_run_cb( struct pattern_set *ps, xmlDocPtr doc, const char *cand,
+	set_callback cb, void *user );
+struct match *pattern_set_run( struct pattern_set *ps, xmlDocPtr doc, const char *cand );
+void machine_budget( struct machine *m, long steps, long msec );
+int document_status( struct machine *m );
+void pattern_set_budget( struct pattern_set *ps, long steps, long msec );
+int pattern_set_status( struct pattern_set *ps );
+struct match *document_process_parallel( struct machine *m, xmlDocPtr doc, int nthreads );
+int treexpr_batch_run( struct machine **m, int nm, xmlDocPtr *doc, int nd,
+	struct match **results, int nthreads );
+int treexpr_records( struct machine *m, const char *filename, const char *record, int options,
+	match_callback cb, void *user, int nthreads );
+struct stream *new_stream( struct machine *m, int html, int options, stream_callback cb, void *user );
+int stream_push( struct stream *st, const char *buf, int len );
+int stream_finish( struct stream *st );
+void free_stream( struct stream *st );
+struct doc_index *treexpr_index_doc( xmlDocPtr doc );
+void free_doc_index( struct doc_index *idx );
+int index_ancestor( struct doc_index *idx, xmlNodePtr a, xmlNodePtr b );
+int index_process_cb( struct machine *m, struct doc_index *idx, match_callback cb, void *user );
+struct match *index_process( struct machine *m, struct doc_index *idx );
+struct snapshot *treexpr_snapshot( xmlDocPtr doc );
+void free_snapshot( struct snapshot *s );
+const char *snapshot_name( struct snapshot *s, int node );
+const char *snapshot_content( struct snapshot *s, int node, int *len );
+int snapshot_process_cb( struct machine *m, struct snapshot *s, snap_callback cb, void *user );
+struct match *snapshot_process( struct machine *m, struct snapshot *s );
+struct snapshot *treexpr_libxml_names( xmlDocPtr doc );
+int adapter_process_cb( struct machine *m, const struct tree_adapter *ta, void *tree, void *root,
+	tree_callback cb, void *user );
+struct json_doc *treexpr_json( const char *buf, size_t len );
+void free_json( struct json_doc *j );
+int json_tag( struct json_doc *j, const char *name );
+const char *json_name( struct json_doc *j, int node, size_t *len );
+const char *json_content( struct json_doc *j, int node, size_t *len );
+int json_process_cb( struct machine *m, struct json_doc *j, json_callback cb, void *user );
+struct match *json_process( struct machine *m, struct json_doc *j );
 
 #endif